@@ -0,0 +1,211 @@
+#ifndef ECHO_H
+#define ECHO_H
+
+// echo shared by myecho and the MicroShell builtin. The line is gathered as
+// an iovec array pointing into the arguments themselves and written with a
+// single writev(). With -e, memchr() finds the next backslash so the text
+// between escapes goes out as one iovec. Decoded escape bytes are kept in a
+// scratch buffer that the iovecs also point into.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+typedef struct {
+	struct iovec *iov;
+	int count, cap;
+	char *scratch;		// decoded escapes; sized up front so it never moves
+	size_t used;
+	int newline;		// cleared by -n and by \c
+} EchoLine;
+
+static int echo_push(EchoLine *l, const char *data, size_t len){
+	if(len==0) return 0;
+	// Decoded escapes land next to each other, so they usually extend the last iovec
+	if(l->count>0){
+		struct iovec *last=&l->iov[l->count-1];
+		if((char *)last->iov_base+last->iov_len==data){
+			last->iov_len+=len;
+			return 0;
+		}
+	}
+	if(l->count==l->cap){
+		int cap=l->cap ? l->cap*2 : 16;
+		struct iovec *iov=(struct iovec *)realloc(l->iov,cap*sizeof(*iov));
+		if(iov==NULL) return -1;
+		l->iov=iov;
+		l->cap=cap;
+	}
+	l->iov[l->count].iov_base=(void *)data;
+	l->iov[l->count].iov_len=len;
+	l->count++;
+	return 0;
+}
+
+// An argument made only of n, e and E after a dash is an option, as in bash
+static int echo_option(const char *arg, int *newline, int *escapes){
+	if(arg[0]!='-' || arg[1]=='\0') return 0;
+	for(const char *p=arg+1;*p;p++){
+		if(*p!='n' && *p!='e' && *p!='E') return 0;
+	}
+	for(const char *p=arg+1;*p;p++){
+		if(*p=='n') *newline=0;
+		else *escapes=*p=='e';
+	}
+	return 1;
+}
+
+static int echo_hex(char c){
+	if(c>='0' && c<='9') return c-'0';
+	if(c>='a' && c<='f') return c-'a'+10;
+	if(c>='A' && c<='F') return c-'A'+10;
+	return -1;
+}
+
+// Decode the escape at p (just after the backslash) into *out.
+// Returns the number of bytes consumed, 0 for \c, -1 if not an escape.
+static int echo_escape(const char *p, const char *end, char *out){
+	const char *simple="\\\\a\ab\be\033f\fn\nr\rt\tv\v";
+	if(p==end) return -1;
+	if(*p=='c') return 0;
+	for(const char *s=simple;*s;s+=2){
+		if(*p==s[0]){
+			*out=s[1];
+			return 1;
+		}
+	}
+	if(*p=='0'){
+		int v=0, n=1;
+		while(n<4 && p+n<end && p[n]>='0' && p[n]<='7') v=v*8+p[n++]-'0';
+		*out=(char)v;
+		return n;
+	}
+	if(*p=='x' && p+1<end && echo_hex(p[1])>=0){
+		int v=echo_hex(p[1]), n=2;
+		if(p+2<end && echo_hex(p[2])>=0) v=v*16+echo_hex(p[n++]);
+		*out=(char)v;
+		return n;
+	}
+	return -1;
+}
+
+// Add one argument with escapes processed; returns 1 if \c ended the output
+static int echo_push_escaped(EchoLine *l, const char *p, const char *end){
+	while(p<end){
+		const char *q=(const char *)memchr(p,'\\',end-p);
+		if(q==NULL) q=end;
+		if(echo_push(l,p,q-p)<0) return -1;
+		if(q==end) break;
+
+		char *out=l->scratch+l->used;
+		int n=echo_escape(q+1,end,out);
+		if(n==0) return 1;
+		if(n<0){
+			// Unknown escape: keep the backslash as ordinary text
+			if(echo_push(l,q,1)<0) return -1;
+			p=q+1;
+			continue;
+		}
+		l->used++;
+		if(echo_push(l,out,1)<0) return -1;
+		p=q+1+n;
+	}
+	return 0;
+}
+
+// Build the line for `echo args...` (args[0] is the command name)
+static int echo_build(EchoLine *l, char **args){
+	int escapes=0, i=1;
+	size_t total=0;
+
+	memset(l,0,sizeof(*l));
+	l->newline=1;
+	while(args[i] && echo_option(args[i],&l->newline,&escapes)) i++;
+
+	if(escapes){
+		// Every escape is at least two bytes and decodes to one
+		for(int j=i;args[j];j++) total+=strlen(args[j]);
+		if((l->scratch=(char *)malloc(total+1))==NULL) return -1;
+	}
+	for(int first=i;args[i];i++){
+		if(i>first && echo_push(l," ",1)<0) return -1;
+		size_t len=strlen(args[i]);
+		if(!escapes){
+			if(echo_push(l,args[i],len)<0) return -1;
+			continue;
+		}
+		int rc=echo_push_escaped(l,args[i],args[i]+len);
+		if(rc<0) return -1;
+		if(rc==1){
+			l->newline=0;
+			return 0;
+		}
+	}
+	if(l->newline && echo_push(l,"\n",1)<0) return -1;
+	return 0;
+}
+
+static size_t echo_length(const EchoLine *l){
+	size_t len=0;
+	for(int i=0;i<l->count;i++) len+=l->iov[i].iov_len;
+	return len;
+}
+
+// Copy the line into buf, which must hold echo_length() bytes
+static void echo_flatten(const EchoLine *l, char *buf){
+	for(int i=0;i<l->count;i++){
+		memcpy(buf,l->iov[i].iov_base,l->iov[i].iov_len);
+		buf+=l->iov[i].iov_len;
+	}
+}
+
+// Write the whole line, normally with one writev(). A line with more than
+// IOV_MAX pieces is flattened into one buffer and written with write().
+static int echo_write(int fd, EchoLine *l){
+	struct iovec *iov=l->iov, single;
+	int count=l->count;
+	char *flat=NULL;
+
+	if(count>IOV_MAX){
+		single.iov_len=echo_length(l);
+		if((flat=(char *)malloc(single.iov_len))==NULL) return -1;
+		echo_flatten(l,flat);
+		single.iov_base=flat;
+		iov=&single;
+		count=1;
+	}
+	while(count>0){
+		ssize_t n=writev(fd,iov,count);
+		if(n<0){
+			if(errno==EINTR) continue;
+			free(flat);
+			return -1;
+		}
+		// Short write (pipe or signal): skip what went out and retry the rest
+		while(count>0 && (size_t)n>=iov->iov_len){
+			n-=iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count>0){
+			iov->iov_base=(char *)iov->iov_base+n;
+			iov->iov_len-=n;
+		}
+	}
+	free(flat);
+	return 0;
+}
+
+static void echo_free(EchoLine *l){
+	free(l->iov);
+	free(l->scratch);
+}
+
+#endif
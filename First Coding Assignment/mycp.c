@@ -1,17 +1,1121 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include "throttle.h"
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <ftw.h>
+#include <stdint.h>
 
-#define COUNT 100
+// --bwlimit / --iops-limit; every copy path below reports its I/O here
+Throttle throttle=THROTTLE_INIT;
+
+#define FANOUT_BLOCK (1 << 20)	// bytes read from the source at a time
+#define FANOUT_WINDOW 8		// blocks a fast destination may run ahead of the slowest
+
+// --fanout: the source is read once and every destination is written by its
+// own thread. Blocks go source -> pipe and are tee(2)d into one pipe per
+// destination, which that destination's thread splices into its file, so
+// the data is never copied through user space. Each destination pipe is the
+// window a fast destination can get ahead by. When the source cannot be
+// spliced, blocks go through a ring of FANOUT_WINDOW shared buffers instead.
+
+typedef struct {
+	char *data[FANOUT_WINDOW];
+	ssize_t len[FANOUT_WINDOW];
+	long produced;		// blocks read from the source so far
+	int eof;
+	pthread_mutex_t lock;
+	pthread_cond_t more;	// a block was produced
+	pthread_cond_t room;	// a destination released a block
+} Ring;
+
+typedef struct {
+	const char *path;
+	int fd;
+	int pipe_r;		// zero-copy mode: this destination's pipe
+	int pipe_w;
+	Ring *ring;		// buffer mode
+	long next;		// buffer mode: next block to write
+	int err;		// errno of the first failure, 0 if fine
+	int started;		// its writer thread is running and must be joined
+} Dest;
+
+int write_all(int fd, const char *buf, size_t len){
+	while(len>0){
+		ssize_t n=write(fd,buf,len);
+		if(n<0){
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		buf+=n;
+		len-=n;
+	}
+	return 0;
+}
+
+void *splice_writer(void *arg){
+	Dest *d=(Dest *)arg;
+	ssize_t n;
+
+	while((n=splice(d->pipe_r,NULL,d->fd,NULL,throttle_chunk(&throttle,FANOUT_BLOCK),SPLICE_F_MOVE))>0){
+		throttle_account(&throttle,0,n,1);
+	}
+	if(n<0 && errno==EINVAL){
+		// Destination file system cannot splice: copy out of the pipe
+		char *buf=malloc(FANOUT_BLOCK);
+		while(buf && (n=read(d->pipe_r,buf,throttle_chunk(&throttle,FANOUT_BLOCK)))>0){
+			if(write_all(d->fd,buf,n)<0){
+				n=-1;
+				break;
+			}
+			throttle_account(&throttle,0,n,1);
+		}
+		free(buf);
+	}
+	if(n<0) d->err=errno;
+	// Unblocks the reader if we gave up early
+	close(d->pipe_r);
+	return NULL;
+}
+
+void *ring_writer(void *arg){
+	Dest *d=(Dest *)arg;
+	Ring *r=d->ring;
+
+	pthread_mutex_lock(&r->lock);
+	while(1){
+		while(d->next==r->produced && !r->eof)
+			pthread_cond_wait(&r->more,&r->lock);
+		if(d->next==r->produced) break;
+
+		int slot=d->next%FANOUT_WINDOW;
+		pthread_mutex_unlock(&r->lock);
+		// The slot stays ours until we advance next
+		int failed=write_all(d->fd,r->data[slot],r->len[slot])<0;
+		if(!failed) throttle_account(&throttle,0,r->len[slot],1);
+		pthread_mutex_lock(&r->lock);
+
+		if(failed){
+			d->err=errno;
+			d->next=LONG_MAX;
+		}else{
+			d->next++;
+		}
+		pthread_cond_broadcast(&r->room);
+		if(failed) break;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+// Copy with shared buffers; the reader waits while the slowest destination
+// is FANOUT_WINDOW blocks behind
+int fanout_ring(int fd, Dest *dests, int ndest){
+	Ring r;
+	pthread_t tids[ndest];
+	int rc=0;
+
+	memset(&r,0,sizeof(r));
+	pthread_mutex_init(&r.lock,NULL);
+	pthread_cond_init(&r.more,NULL);
+	pthread_cond_init(&r.room,NULL);
+	for(int i=0;i<FANOUT_WINDOW;i++){
+		r.data[i]=malloc(FANOUT_BLOCK);
+		if(!r.data[i]){
+			printf("Out of memory\n");
+			exit(-4);
+		}
+	}
+	for(int i=0;i<ndest;i++){
+		dests[i].ring=&r;
+		dests[i].next=0;
+		int err=pthread_create(&tids[i],NULL,ring_writer,&dests[i]);
+		dests[i].started=err==0;
+		if(err){
+			// No writer: the destination fails and never holds the reader back
+			dests[i].err=err;
+			dests[i].next=LONG_MAX;
+		}
+	}
+
+	while(1){
+		pthread_mutex_lock(&r.lock);
+		while(1){
+			long slowest=LONG_MAX;
+			for(int i=0;i<ndest;i++)
+				if(dests[i].next<slowest) slowest=dests[i].next;
+			if(r.produced-slowest<FANOUT_WINDOW) break;
+			pthread_cond_wait(&r.room,&r.lock);
+		}
+		pthread_mutex_unlock(&r.lock);
+
+		// Nobody reads this slot until produced moves past it
+		int slot=r.produced%FANOUT_WINDOW;
+		ssize_t n;
+		while((n=read(fd,r.data[slot],throttle_chunk(&throttle,FANOUT_BLOCK)))<0 && errno==EINTR){
+		}
+		throttle_account(&throttle,n>0 ? n : 0,0,1);
+
+		pthread_mutex_lock(&r.lock);
+		if(n<=0){
+			if(n<0){
+				perror("read failed");
+				rc=-1;
+			}
+			r.eof=1;
+		}else{
+			r.len[slot]=n;
+			r.produced++;
+		}
+		pthread_cond_broadcast(&r.more);
+		pthread_mutex_unlock(&r.lock);
+		if(n<=0) break;
+	}
+
+	for(int i=0;i<ndest;i++) if(dests[i].started) pthread_join(tids[i],NULL);
+	for(int i=0;i<FANOUT_WINDOW;i++) free(r.data[i]);
+	pthread_mutex_destroy(&r.lock);
+	pthread_cond_destroy(&r.more);
+	pthread_cond_destroy(&r.room);
+	return rc;
+}
+
+// Zero-copy copy through pipes. Returns 1 if the source cannot be spliced
+// (nothing has been written yet), 0 on success, -1 on a read error.
+int fanout_splice(int fd, Dest *dests, int ndest){
+	int src[2];
+	pthread_t tids[ndest];
+	char *bounce=NULL;
+	int rc=0;
+
+	if(pipe2(src,O_CLOEXEC)<0) return 1;
+	fcntl(src[0],F_SETPIPE_SZ,FANOUT_BLOCK);
+
+	ssize_t n=splice(fd,NULL,src[1],NULL,throttle_chunk(&throttle,FANOUT_BLOCK),SPLICE_F_MOVE);
+	if(n<0){
+		close(src[0]);
+		close(src[1]);
+		return 1;
+	}
+	throttle_account(&throttle,n,0,1);
+
+	for(int i=0;i<ndest;i++){
+		int p[2];
+		if(pipe2(p,O_CLOEXEC)<0){
+			perror("pipe");
+			exit(-4);
+		}
+		fcntl(p[0],F_SETPIPE_SZ,FANOUT_BLOCK);
+		dests[i].pipe_r=p[0];
+		dests[i].pipe_w=p[1];
+		int err=pthread_create(&tids[i],NULL,splice_writer,&dests[i]);
+		dests[i].started=err==0;
+		if(err){
+			// Nobody would drain its pipe and tee would block on it
+			dests[i].err=err;
+			close(p[0]);
+			close(p[1]);
+			dests[i].pipe_w=-1;
+		}
+	}
+
+	// A destination that failed closes its pipe; we get EPIPE, not a signal
+	signal(SIGPIPE,SIG_IGN);
+	int devnull=open("/dev/null",O_WRONLY|O_CLOEXEC);
+
+	while(n>0){
+		int short_tee=0;
+		ssize_t done[ndest];
+
+		for(int i=0;i<ndest;i++){
+			done[i]=n;
+			if(dests[i].pipe_w<0) continue;
+			ssize_t t=tee(src[0],dests[i].pipe_w,n,0);
+			if(t<0){
+				close(dests[i].pipe_w);
+				dests[i].pipe_w=-1;
+				continue;
+			}
+			done[i]=t;
+			if(t<n) short_tee=1;
+		}
+
+		if(!short_tee && devnull>=0 && splice(src[0],NULL,devnull,NULL,n,SPLICE_F_MOVE)==n){
+			// Block consumed by every destination's pipe
+		}else{
+			// tee cannot resume part way through a pipe: finish the
+			// destinations that got a short tee from a copy of the block
+			if(!bounce && !(bounce=malloc(FANOUT_BLOCK))){
+				printf("Out of memory\n");
+				exit(-4);
+			}
+			ssize_t got=0,r;
+			while(got<n && (r=read(src[0],bounce+got,n-got))>0) got+=r;
+			for(int i=0;i<ndest;i++){
+				if(dests[i].pipe_w<0 || done[i]>=n) continue;
+				if(write_all(dests[i].pipe_w,bounce+done[i],n-done[i])<0){
+					close(dests[i].pipe_w);
+					dests[i].pipe_w=-1;
+				}
+			}
+		}
+
+		n=splice(fd,NULL,src[1],NULL,throttle_chunk(&throttle,FANOUT_BLOCK),SPLICE_F_MOVE);
+		throttle_account(&throttle,n>0 ? n : 0,0,1);
+	}
+	if(n<0){
+		perror("read failed");
+		rc=-1;
+	}
+
+	for(int i=0;i<ndest;i++){
+		if(dests[i].pipe_w>=0) close(dests[i].pipe_w);
+		if(dests[i].started) pthread_join(tids[i],NULL);
+	}
+	if(devnull>=0) close(devnull);
+	free(bounce);
+	close(src[0]);
+	close(src[1]);
+	return rc;
+}
+
+int fanout(int argc, char* argv[]){
+	int ndest=argc-2;
+	Dest dests[ndest];
+
+	int fd=open(argv[1],O_RDONLY);
+	if(fd<0){
+		printf("coudlnt open the file\n");
+		exit(-2);
+	}
+
+	int openFlags = O_CREAT | O_WRONLY | O_TRUNC;
+	mode_t  filePerms = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+	for(int i=0;i<ndest;i++){
+		memset(&dests[i],0,sizeof(Dest));
+		dests[i].path=argv[i+2];
+		dests[i].fd=open(dests[i].path,openFlags|O_CLOEXEC,filePerms);
+		if(dests[i].fd<0){
+			perror(dests[i].path);
+			exit(-3);
+		}
+	}
+
+	int rc=fanout_splice(fd,dests,ndest);
+	if(rc==1) rc=fanout_ring(fd,dests,ndest);
+
+	for(int i=0;i<ndest;i++){
+		if(dests[i].err){
+			errno=dests[i].err;
+			perror(dests[i].path);
+			rc=-1;
+		}
+		close(dests[i].fd);
+	}
+	close(fd);
+	return rc<0 ? -3 : 0;
+}
+
+// Copy strategies. Which one is fastest depends on the file systems
+// involved, so `--autotune` times each on a sample of the source, and the
+// winner is remembered per (st_dev, file system type) of source and target
+// in a small profile cache that later copies consult.
+
+#define DEFAULT_BUF (128 << 10)
+#define TUNE_SAMPLE (32 << 20)		// bytes copied per calibration run
+#define DIRECT_ALIGN 4096
+#define MAX_THREADS 16
+
+enum { COPY_RW, COPY_CFR, COPY_MMAP, COPY_DIRECT, COPY_STRATEGIES };
+
+const char *strategy_names[COPY_STRATEGIES] = { "read/write", "copy_file_range", "mmap", "O_DIRECT" };
+
+typedef struct {
+	int strategy;
+	size_t bufsize;
+	int threads;
+} CopyPlan;
+
+typedef struct {
+	unsigned long src_dev;
+	long src_fs;
+	unsigned long dst_dev;
+	long dst_fs;
+	CopyPlan plan;
+	double mbps;
+} Profile;
+
+typedef struct {
+	int in;
+	int out;
+	off_t off;
+	off_t len;
+	const CopyPlan *plan;
+	const char *map;	// COPY_MMAP: the whole source
+	int err;
+	int started;		// runs on its own thread, to be joined
+} CopyJob;
+
+const CopyPlan default_plan = { COPY_RW, DEFAULT_BUF, 1 };
+
+const CopyPlan tune_candidates[] = {
+	{ COPY_RW, 64 << 10, 1 },
+	{ COPY_RW, 1 << 20, 1 },
+	{ COPY_RW, 1 << 20, 4 },
+	{ COPY_CFR, 8 << 20, 1 },
+	{ COPY_CFR, 8 << 20, 4 },
+	{ COPY_MMAP, 1 << 20, 1 },
+	{ COPY_MMAP, 1 << 20, 4 },
+	{ COPY_DIRECT, 1 << 20, 1 },
+	{ COPY_DIRECT, 1 << 20, 4 },
+};
+
+int pwrite_all(int fd, const char *buf, size_t len, off_t off){
+	while(len>0){
+		ssize_t n=pwrite(fd,buf,len,off);
+		if(n<0){
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		buf+=n;
+		len-=n;
+		off+=n;
+	}
+	return 0;
+}
+
+void *copy_range(void *arg){
+	CopyJob *j=(CopyJob *)arg;
+	const CopyPlan *p=j->plan;
+	off_t off=j->off, end=j->off+j->len;
+	char *buf=NULL;
+
+	if(p->strategy==COPY_RW || p->strategy==COPY_DIRECT){
+		// Aligned for O_DIRECT; harmless otherwise
+		buf=aligned_alloc(DIRECT_ALIGN,p->bufsize);
+		if(!buf){
+			j->err=ENOMEM;
+			return NULL;
+		}
+	}
+
+	while(off<end){
+		size_t chunk=end-off<(off_t)p->bufsize ? (size_t)(end-off) : p->bufsize;
+		ssize_t n;
+
+		// O_DIRECT needs whole blocks, so only the other strategies shrink chunks
+		if(p->strategy!=COPY_DIRECT) chunk=throttle_chunk(&throttle,chunk);
+
+		if(p->strategy==COPY_CFR){
+			loff_t in_off=off, out_off=off;
+			n=copy_file_range(j->in,&in_off,j->out,&out_off,chunk,0);
+		}else if(p->strategy==COPY_MMAP){
+			n=pwrite_all(j->out,j->map+off,chunk,off)<0 ? -1 : (ssize_t)chunk;
+		}else{
+			n=pread(j->in,buf,chunk,off);
+			throttle_account(&throttle,n>0 ? n : 0,0,1);
+			if(n>0 && pwrite_all(j->out,buf,n,off)<0) n=-1;
+		}
+		if(n<0){
+			if(errno==EINTR) continue;
+			j->err=errno;
+			break;
+		}
+		if(n==0) break;	// source got shorter
+		// copy_file_range and mmap read the source as they write
+		throttle_account(&throttle,p->strategy==COPY_CFR || p->strategy==COPY_MMAP ? n : 0,n,1);
+		off+=n;
+	}
+	free(buf);
+	return NULL;
+}
+
+// Copy the first `size` bytes of in to out following plan. Returns -1 with
+// errno set on failure; EINVAL, EXDEV, ENOSYS or EOPNOTSUPP mean the
+// strategy is not supported here.
+int copy_fds(int in, int out, off_t size, const CopyPlan *plan){
+	CopyJob jobs[MAX_THREADS];
+	pthread_t tids[MAX_THREADS];
+	char *map=NULL;
+	off_t body=size;
+	int out_flags=fcntl(out,F_GETFL);
+	int err=0;
+
+	if(size==0) return 0;
+	if(plan->strategy==COPY_DIRECT){
+		if(fcntl(out,F_SETFL,out_flags|O_DIRECT)<0) return -1;
+		body=size&~(off_t)(DIRECT_ALIGN-1);	// unaligned tail written below
+	}
+	if(plan->strategy==COPY_MMAP){
+		map=mmap(NULL,size,PROT_READ,MAP_SHARED,in,0);
+		if(map==MAP_FAILED) return -1;
+		madvise(map,size,MADV_SEQUENTIAL);
+	}
+
+	// Give each thread a whole number of buffers
+	int threads=plan->threads<MAX_THREADS ? plan->threads : MAX_THREADS;
+	off_t per=(body/threads+plan->bufsize-1)/plan->bufsize*plan->bufsize;
+	if(per==0) threads=1;
+	for(int i=0;i<threads;i++){
+		jobs[i].in=in;
+		jobs[i].out=out;
+		jobs[i].off=i*per;
+		// Rounding up to whole buffers can leave the last threads less
+		// than per, or nothing; no range may go past body (or the mapping)
+		jobs[i].len=jobs[i].off<body ? body-jobs[i].off : 0;
+		if(jobs[i].len>per) jobs[i].len=per;
+		jobs[i].plan=plan;
+		jobs[i].map=map;
+		jobs[i].err=0;
+		jobs[i].started=0;
+		if(i==0 || jobs[i].len==0) continue;
+		jobs[i].started=pthread_create(&tids[i],NULL,copy_range,&jobs[i])==0;
+		if(!jobs[i].started) copy_range(&jobs[i]);
+	}
+	copy_range(&jobs[0]);
+	for(int i=1;i<threads;i++) if(jobs[i].started) pthread_join(tids[i],NULL);
+	for(int i=0;i<threads;i++) if(jobs[i].err && !err) err=jobs[i].err;
+
+	if(plan->strategy==COPY_DIRECT){
+		fcntl(out,F_SETFL,out_flags);
+		if(!err && body<size){
+			CopyJob tail={ in, out, body, size-body, &default_plan, NULL, 0, 0 };
+			copy_range(&tail);
+			err=tail.err;
+		}
+	}
+	if(map) munmap(map,size);
+	if(err){
+		errno=err;
+		return -1;
+	}
+	return 0;
+}
+
+int strategy_unsupported(int err){
+	return err==EINVAL || err==EXDEV || err==ENOSYS || err==EOPNOTSUPP || err==ENODEV;
+}
+
+const char *fs_name(long type){
+	switch(type){
+	case 0x01021994: return "tmpfs";
+	case 0xEF53: return "ext4";
+	case 0x58465342: return "xfs";
+	case 0x794c7630: return "overlay";
+	case 0x9123683E: return "btrfs";
+	case 0x6969: return "nfs";
+	}
+	return "other";
+}
+
+// st_dev and file system type of path, or of its directory if it does not exist
+int fs_key(const char *path, unsigned long *dev, long *type){
+	struct stat st;
+	struct statfs sfs;
+	char dir[PATH_MAX];
+
+	if(stat(path,&st)<0 || statfs(path,&sfs)<0){
+		snprintf(dir,sizeof(dir),"%s",path);
+		char *slash=strrchr(dir,'/');
+		if(slash==dir) dir[1]='\0';
+		else if(slash) *slash='\0';
+		else strcpy(dir,".");
+		if(stat(dir,&st)<0 || statfs(dir,&sfs)<0) return -1;
+	}
+	*dev=st.st_dev;
+	*type=sfs.f_type;
+	return 0;
+}
+
+void profile_path(char *path, size_t len){
+	const char *env=getenv("MYCP_PROFILES");
+	const char *cache=getenv("XDG_CACHE_HOME");
+	const char *home=getenv("HOME");
+
+	if(env) snprintf(path,len,"%s",env);
+	else if(cache) snprintf(path,len,"%s/mycp-profiles",cache);
+	else snprintf(path,len,"%s/.cache/mycp-profiles",home ? home : ".");
+}
+
+// mkdir -p of the directory holding path
+void make_parents(const char *path){
+	char dir[PATH_MAX];
+	snprintf(dir,sizeof(dir),"%s",path);
+	for(char *p=dir+1;*p;p++){
+		if(*p!='/') continue;
+		*p='\0';
+		mkdir(dir,0700);
+		*p='/';
+	}
+}
+
+int load_profiles(Profile *profiles, int max){
+	char path[PATH_MAX];
+	profile_path(path,sizeof(path));
+	FILE *f=fopen(path,"r");
+	if(!f) return 0;
+
+	int count=0;
+	Profile p;
+	while(count<max && fscanf(f,"%lu %ld %lu %ld %d %zu %d %lf",&p.src_dev,&p.src_fs,&p.dst_dev,&p.dst_fs,
+	      &p.plan.strategy,&p.plan.bufsize,&p.plan.threads,&p.mbps)==8){
+		if(p.plan.strategy<0 || p.plan.strategy>=COPY_STRATEGIES || p.plan.bufsize==0 ||
+		   p.plan.threads<1) continue;
+		profiles[count++]=p;
+	}
+	fclose(f);
+	return count;
+}
+
+#define MAX_PROFILES 64
+
+const Profile *find_profile(Profile *profiles, int count, const Profile *key){
+	for(int i=0;i<count;i++){
+		if(profiles[i].src_dev==key->src_dev && profiles[i].src_fs==key->src_fs &&
+		   profiles[i].dst_dev==key->dst_dev && profiles[i].dst_fs==key->dst_fs)
+			return &profiles[i];
+	}
+	return NULL;
+}
+
+void save_profile(const Profile *p){
+	Profile profiles[MAX_PROFILES];
+	int count=load_profiles(profiles,MAX_PROFILES);
+	Profile *old=(Profile *)find_profile(profiles,count,p);
+
+	if(old) *old=*p;
+	else if(count<MAX_PROFILES) profiles[count++]=*p;
+	else profiles[0]=*p;	// full: forget the oldest
+
+	// Write a new file and rename it over the old one
+	char path[PATH_MAX], tmp[PATH_MAX+8];
+	profile_path(path,sizeof(path));
+	make_parents(path);
+	snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+	FILE *f=fopen(tmp,"w");
+	if(!f){
+		perror(tmp);
+		return;
+	}
+	for(int i=0;i<count;i++){
+		fprintf(f,"%lu %ld %lu %ld %d %zu %d %.1f\n",profiles[i].src_dev,profiles[i].src_fs,
+			profiles[i].dst_dev,profiles[i].dst_fs,profiles[i].plan.strategy,
+			profiles[i].plan.bufsize,profiles[i].plan.threads,profiles[i].mbps);
+	}
+	if(fclose(f)!=0 || rename(tmp,path)<0) perror(path);
+}
+
+void show_profiles(void){
+	Profile profiles[MAX_PROFILES];
+	char path[PATH_MAX];
+	int count=load_profiles(profiles,MAX_PROFILES);
+
+	profile_path(path,sizeof(path));
+	printf("%s: %d profile(s)\n",path,count);
+	for(int i=0;i<count;i++){
+		Profile *p=&profiles[i];
+		printf("  %s (dev %lu:%lu) -> %s (dev %lu:%lu): %s, %zuK buffer, %d thread(s), %.1f MB/s\n",
+		       fs_name(p->src_fs),(unsigned long)major(p->src_dev),(unsigned long)minor(p->src_dev),
+		       fs_name(p->dst_fs),(unsigned long)major(p->dst_dev),(unsigned long)minor(p->dst_dev),strategy_names[p->plan.strategy],p->plan.bufsize>>10,p->plan.threads,p->mbps);
+	}
+}
+
+double now_seconds(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+// Time every candidate copying the start of src next to dst and store the
+// fastest in the profile cache
+int autotune(const char *src, const char *dst, Profile *best){
+	char tmp[PATH_MAX];
+	struct stat st;
+
+	// What the caller copies with if tuning fails before timing anything
+	best->plan=default_plan;
+	best->mbps=0;
+	if(fs_key(src,&best->src_dev,&best->src_fs)<0 || fs_key(dst,&best->dst_dev,&best->dst_fs)<0){
+		perror("autotune");
+		return -1;
+	}
+	int in=open(src,O_RDONLY);
+	if(in<0 || fstat(in,&st)<0){
+		printf("coudlnt open the file\n");
+		exit(-2);
+	}
+	off_t sample=st.st_size<TUNE_SAMPLE ? st.st_size : TUNE_SAMPLE;
+	if(sample<(1<<20)) printf("autotune: %s is small, timings will be rough\n",src);
+
+	const char *slash=strrchr(dst,'/');
+	if(slash) snprintf(tmp,sizeof(tmp),"%.*s/.mycp-tune-XXXXXX",(int)(slash-dst),dst);
+	else snprintf(tmp,sizeof(tmp),".mycp-tune-XXXXXX");
+	int out=mkstemp(tmp);
+	if(out<0){
+		perror(tmp);
+		close(in);
+		return -1;
+	}
+
+	// Warm the page cache so the first candidate is not charged for it
+	CopyJob warm={ in, out, 0, sample, &default_plan, NULL, 0, 0 };
+	copy_range(&warm);
+
+	for(size_t i=0;i<sizeof(tune_candidates)/sizeof(tune_candidates[0]);i++){
+		const CopyPlan *p=&tune_candidates[i];
+		if(ftruncate(out,0)<0) break;
+
+		double start=now_seconds();
+		int rc=copy_fds(in,out,sample,p);
+		if(rc==0) rc=fdatasync(out);
+		double secs=now_seconds()-start;
+
+		printf("  %-16s %5zuK buffer, %d thread(s): ",strategy_names[p->strategy],p->bufsize>>10,p->threads);
+		if(rc<0){
+			printf("%s\n",strerror(errno));
+			continue;
+		}
+		double mbps=sample/1048576.0/(secs>1e-6 ? secs : 1e-6);
+		printf("%.1f MB/s\n",mbps);
+		if(mbps>best->mbps){
+			best->mbps=mbps;
+			best->plan=*p;
+		}
+	}
+	close(out);
+	unlink(tmp);
+	close(in);
+
+	if(best->mbps==0) return -1;
+	printf("autotune: using %s, %zuK buffer, %d thread(s)\n",strategy_names[best->plan.strategy],
+	       best->plan.bufsize>>10,best->plan.threads);
+	save_profile(best);
+	return 0;
+}
+
+// The plan to copy src to dst with: the cached profile if there is one
+CopyPlan pick_plan(const char *src, const char *dst){
+	Profile key, profiles[MAX_PROFILES];
+	if(fs_key(src,&key.src_dev,&key.src_fs)<0 || fs_key(dst,&key.dst_dev,&key.dst_fs)<0)
+		return default_plan;
+	const Profile *p=find_profile(profiles,load_profiles(profiles,MAX_PROFILES),&key);
+	return p ? p->plan : default_plan;
+}
+
+// Copy an open source to an open target with plan, falling back to plain
+// read/write where the plan's strategy is not supported
+int copy_file_fds(int fd, int fd2, const CopyPlan *plan){
+	struct stat st;
+	if(fstat(fd,&st)==0 && S_ISREG(st.st_mode) && st.st_size>0){
+		int rc=copy_fds(fd,fd2,st.st_size,plan);
+		if(rc<0 && strategy_unsupported(errno) && plan->strategy!=COPY_RW)
+			rc=copy_fds(fd,fd2,st.st_size,&default_plan);
+		return rc;
+	}
+
+	// Pipes, devices and /proc files: copy until EOF
+	char *buf=malloc(DEFAULT_BUF);
+	ssize_t num_read;
+	if(!buf) return -1;
+	while((num_read=read(fd,buf,throttle_chunk(&throttle,DEFAULT_BUF)))>0){
+		if(write_all(fd2,buf,num_read)<0){
+			free(buf);
+			return -1;
+		}
+		throttle_account(&throttle,num_read,num_read,2);
+	}
+	free(buf);
+	return num_read<0 ? -1 : 0;
+}
+
+// --dedup: copy a tree, reproducing hard links with linkat() and turning
+// files whose content already exists in the target into reflink clones
+// (FICLONE) of the earlier copy, or hard links to it where the file system
+// cannot clone. Candidates are found through an index of files by size;
+// their content is hashed only once a second file of the same size turns
+// up, and a match is confirmed byte for byte before anything is shared.
+
+#define DEDUP_BUCKETS 65536
+#define DEDUP_CHUNK (1 << 20)
+
+typedef struct SizeEntry {
+	off_t size;
+	char *src;
+	char *dst;
+	mode_t mode;
+	uint64_t hash;
+	int hashed;
+	struct SizeEntry *next;
+} SizeEntry;
+
+typedef struct InodeEntry {
+	dev_t dev;
+	ino_t ino;
+	char *dst;
+	struct InodeEntry *next;
+} InodeEntry;
+
+typedef struct DirEntry {
+	char *dst;
+	mode_t mode;
+	struct DirEntry *next;
+} DirEntry;
+
+struct {
+	const char *src_root;
+	const char *dst_root;
+	int src_len, dst_len;	// the roots without trailing slashes
+	CopyPlan plan;
+	int allow_links;	// share duplicates by hard link if cloning fails
+	SizeEntry *by_size[DEDUP_BUCKETS];
+	InodeEntry *by_inode[DEDUP_BUCKETS];
+	DirEntry *dirs;		// created directories, most recent first
+	long files, hardlinks, clones, links, errors;
+	unsigned long long copied, saved;
+} dedup;
+
+// Fill buf as far as possible; returns bytes read or -1
+ssize_t read_full(int fd, char *buf, size_t len){
+	size_t got=0;
+	while(got<len){
+		ssize_t n=read(fd,buf+got,throttle_chunk(&throttle,len-got));
+		throttle_account(&throttle,n>0 ? n : 0,0,1);
+		if(n<0){
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		if(n==0) break;
+		got+=n;
+	}
+	return got;
+}
+
+// 64-bit hash of a file's content, a word at a time
+int hash_file(const char *path, uint64_t *out){
+	int fd=open(path,O_RDONLY|O_CLOEXEC);
+	if(fd<0) return -1;
+	posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+
+	uint64_t *buf=malloc(DEDUP_CHUNK);
+	uint64_t h=0x9E3779B97F4A7C15ULL;
+	ssize_t n;
+	while(buf && (n=read(fd,buf,throttle_chunk(&throttle,DEDUP_CHUNK)))>0){
+		throttle_account(&throttle,n,0,1);
+		size_t words=n/8;
+		for(size_t i=0;i<words;i++){
+			h^=buf[i];
+			h*=0xFF51AFD7ED558CCDULL;
+			h^=h>>32;
+		}
+		for(ssize_t i=words*8;i<n;i++){
+			h^=((unsigned char *)buf)[i];
+			h*=0xC4CEB9FE1A85EC53ULL;
+		}
+	}
+	free(buf);
+	close(fd);
+	if(!buf || n<0) return -1;
+	*out=h;
+	return 0;
+}
+
+int same_content(const char *a, const char *b){
+	int fa=open(a,O_RDONLY|O_CLOEXEC), fb=open(b,O_RDONLY|O_CLOEXEC);
+	char *ba=malloc(DEDUP_CHUNK), *bb=malloc(DEDUP_CHUNK);
+	int same=fa>=0 && fb>=0 && ba && bb;
+
+	while(same){
+		ssize_t na=read_full(fa,ba,DEDUP_CHUNK), nb=read_full(fb,bb,DEDUP_CHUNK);
+		if(na!=nb || na<0 || memcmp(ba,bb,na)!=0) same=0;
+		if(na<=0) break;
+	}
+	free(ba);
+	free(bb);
+	if(fa>=0) close(fa);
+	if(fb>=0) close(fb);
+	return same;
+}
+
+// An earlier copy with the same content as src, or NULL
+SizeEntry *find_duplicate(const char *src, off_t size){
+	SizeEntry *e;
+	uint64_t hash=0;
+	int hashed=0;
+
+	for(e=dedup.by_size[size%DEDUP_BUCKETS];e;e=e->next){
+		if(e->size!=size || !e->dst) continue;
+		if(!hashed){
+			if(hash_file(src,&hash)<0) return NULL;
+			hashed=1;
+		}
+		if(!e->hashed){
+			if(hash_file(e->src,&e->hash)<0) continue;
+			e->hashed=1;
+		}
+		if(e->hash==hash && same_content(src,e->src)) return e;
+	}
+
+	// Remember this one for later files of the same size
+	e=calloc(1,sizeof(SizeEntry));
+	if(e){
+		e->size=size;
+		e->src=strdup(src);
+		e->hash=hash;
+		e->hashed=hashed;
+		e->next=dedup.by_size[size%DEDUP_BUCKETS];
+		dedup.by_size[size%DEDUP_BUCKETS]=e;
+	}
+	return NULL;
+}
+
+// Share the earlier copy as `dst`: clone it, else hard link it if the two
+// files have the same permissions
+int share_copy(const SizeEntry *from, const char *dst, mode_t mode){
+	int in=open(from->dst,O_RDONLY|O_CLOEXEC);
+	int out=open(dst,O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC,mode);
+	int cloned=in>=0 && out>=0 && ioctl(out,FICLONE,in)==0;
+	if(cloned) fchmod(out,mode);
+	if(in>=0) close(in);
+	if(out>=0) close(out);
+	if(cloned){
+		dedup.clones++;
+		return 0;
+	}
+	if(dedup.allow_links && from->mode==mode){
+		unlink(dst);
+		if(linkat(AT_FDCWD,from->dst,AT_FDCWD,dst,0)==0){
+			dedup.links++;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int dedup_file(const char *src, const char *dst, const struct stat *st){
+	mode_t mode=st->st_mode&07777;
+
+	// Another name for an inode we already copied
+	InodeEntry **slot=&dedup.by_inode[st->st_ino%DEDUP_BUCKETS];
+	if(st->st_nlink>1){
+		for(InodeEntry *e=*slot;e;e=e->next){
+			if(e->dev==st->st_dev && e->ino==st->st_ino){
+				if(linkat(AT_FDCWD,e->dst,AT_FDCWD,dst,0)<0){
+					perror(dst);
+					return -1;
+				}
+				dedup.hardlinks++;
+				return 0;
+			}
+		}
+	}
+
+	SizeEntry *dup=st->st_size>0 ? find_duplicate(src,st->st_size) : NULL;
+	if(dup && share_copy(dup,dst,mode)==0){
+		dedup.saved+=st->st_size;
+	}else{
+		int fd=open(src,O_RDONLY|O_CLOEXEC);
+		if(fd<0){
+			perror(src);
+			return -1;
+		}
+		int fd2=open(dst,O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC,mode);
+		if(fd2<0 || copy_file_fds(fd,fd2,&dedup.plan)<0){
+			perror(dst);
+			close(fd);
+			if(fd2>=0) close(fd2);
+			return -1;
+		}
+		fchmod(fd2,mode);
+		close(fd);
+		close(fd2);
+		dedup.copied+=st->st_size;
+
+		// Later duplicates are shared from this copy
+		SizeEntry *self=dedup.by_size[st->st_size%DEDUP_BUCKETS];
+		if(st->st_size>0 && self && strcmp(self->src,src)==0){
+			self->dst=strdup(dst);
+			self->mode=mode;
+		}
+	}
+	dedup.files++;
+
+	if(st->st_nlink>1){
+		InodeEntry *e=malloc(sizeof(InodeEntry));
+		if(e){
+			e->dev=st->st_dev;
+			e->ino=st->st_ino;
+			e->dst=strdup(dst);
+			e->next=*slot;
+			*slot=e;
+		}
+	}
+	return 0;
+}
+
+int dedup_visit(const char *path, const struct stat *st, int type, struct FTW *ftw){
+	(void)ftw;
+	char dst[PATH_MAX];
+	if(snprintf(dst,sizeof(dst),"%.*s%s",dedup.dst_len,dedup.dst_root,path+dedup.src_len)>=(int)sizeof(dst)){
+		printf("%s: path too long\n",path);
+		dedup.errors++;
+		return 0;
+	}
+
+	int rc=0;
+	if(type==FTW_D){
+		// Keep the directory writable while we fill it; dedup_tree() gives
+		// it its own mode once everything below it is copied
+		if(mkdir(dst,(st->st_mode&07777)|S_IRWXU)<0 && errno!=EEXIST) rc=-1;
+		DirEntry *d=rc==0 ? malloc(sizeof(DirEntry)) : NULL;
+		if(d){
+			d->dst=strdup(dst);
+			d->mode=st->st_mode&07777;
+			d->next=dedup.dirs;
+			dedup.dirs=d;
+		}
+	}else if(type==FTW_SL){
+		char target[PATH_MAX];
+		ssize_t n=readlink(path,target,sizeof(target)-1);
+		if(n>=0){
+			target[n]='\0';
+			rc=symlink(target,dst);
+		}else{
+			rc=-1;
+		}
+	}else if(type==FTW_F && S_ISREG(st->st_mode)){
+		if(dedup_file(path,dst,st)<0) dedup.errors++;
+		return 0;
+	}else if(type==FTW_F){
+		printf("%s: skipping special file\n",path);
+	}else{
+		errno=EACCES;
+		rc=-1;
+	}
+	if(rc<0){
+		perror(dst);
+		dedup.errors++;
+	}
+	return 0;
+}
+
+int dedup_tree(const char *src, const char *dst, int allow_links){
+	struct stat st;
+	if(stat(src,&st)<0){
+		printf("coudlnt open the file\n");
+		exit(-2);
+	}
+
+	// Paths below src are dst plus what follows src, so "s/" and "s" (and
+	// "d/" and "d") must give the same joins
+	dedup.src_root=src;
+	dedup.dst_root=dst;
+	dedup.src_len=strlen(src);
+	dedup.dst_len=strlen(dst);
+	while(dedup.src_len>0 && src[dedup.src_len-1]=='/') dedup.src_len--;
+	while(dedup.dst_len>0 && dst[dedup.dst_len-1]=='/') dedup.dst_len--;
+	dedup.plan=pick_plan(src,dst);
+	dedup.allow_links=allow_links;
+	int walked=nftw(src,dedup_visit,64,FTW_PHYS);
+
+	// Children come before their parents here, so a read-only directory
+	// is only locked once its subdirectories are done
+	while(dedup.dirs){
+		DirEntry *d=dedup.dirs;
+		if(d->dst && chmod(d->dst,d->mode)<0){
+			perror(d->dst);
+			dedup.errors++;
+		}
+		dedup.dirs=d->next;
+		free(d->dst);
+		free(d);
+	}
+	if(walked<0){
+		perror(src);
+		return -3;
+	}
+
+	printf("%ld files: %ld hard links kept, %ld duplicates cloned, %ld hard linked\n",
+	       dedup.files+dedup.hardlinks,dedup.hardlinks,dedup.clones,dedup.links);
+	printf("%.1f MB copied, %.1f MB not copied thanks to duplicates\n",dedup.copied/1048576.0,
+	       dedup.saved/1048576.0);
+	return dedup.errors ? -3 : 0;
+}
 
 int main(int argc, char* argv[]){
-	char buf[COUNT];
+	int use_fanout=0, use_autotune=0, use_dedup=0, used;
+	double bwlimit=0, iopslimit=0;
+
+	// Options may appear anywhere; the other arguments are files
+	int nargs=1;
+	for(int i=1;i<argc;i++){
+		if((used=throttle_option(argv,argc,i,&bwlimit,&iopslimit))>0) i+=used-1;
+		else if(strcmp(argv[i],"--fanout")==0) use_fanout=1;
+		else if(strcmp(argv[i],"--autotune")==0) use_autotune=1;
+		else if(strcmp(argv[i],"--dedup")==0) use_dedup=2;
+		else if(strcmp(argv[i],"--dedup=clone")==0) use_dedup=1;
+		else if(strcmp(argv[i],"--autotune-show")==0){
+			show_profiles();
+			return 0;
+		}else if(strcmp(argv[i],"--autotune-reset")==0){
+			char path[PATH_MAX];
+			profile_path(path,sizeof(path));
+			if(unlink(path)<0 && errno!=ENOENT){
+				perror(path);
+				exit(-4);
+			}
+			return 0;
+		}
+		else argv[nargs++]=argv[i];
+	}
+	argc=nargs;
+
 	if(argc<3){
-        printf("Usage:  %s file-name\n" ,argv[0]);
+        printf("Usage:  %s [--autotune] file-name target\n"
+	       "        (all forms take --bwlimit RATE[K|M|G] and --iops-limit N)\n"
+	       "        %s --dedup[=clone] source-dir target-dir\n"
+	       "        %s file-name target [targets...] --fanout\n"
+	       "        %s --autotune-show | --autotune-reset\n" ,argv[0],argv[0],argv[0],argv[0]);
        exit(-1); //that means im waiting for argv[0] esm el barnamg argv[1] dah el argument ely ha2rah
         }
 
+	int rc=1;
+	throttle_start(&throttle,bwlimit,iopslimit);
+	if(use_fanout) rc=fanout(argc,argv);
+	if(use_dedup && rc==1){
+		struct stat st;
+		if(stat(argv[1],&st)==0 && S_ISDIR(st.st_mode))
+			rc=dedup_tree(argv[1],argv[2],use_dedup==2);
+	}
+	if(rc!=1){
+		if(throttle_active(&throttle)) throttle_report(&throttle,stderr);
+		return rc;
+	}
+
+	CopyPlan plan;
+	if(use_autotune){
+		// Calibrate at full speed; the limits apply to the real copy
+		Profile best;
+		throttle_start(&throttle,0,0);
+		autotune(argv[1],argv[2],&best);
+		throttle_start(&throttle,bwlimit,iopslimit);
+		plan=best.plan;
+	}else{
+		plan=pick_plan(argv[1],argv[2]);
+	}
+
 	int fd=open(argv[1],O_RDONLY);
         if(fd<0){
                 printf("coudlnt open the file\n");
@@ -22,17 +1126,18 @@ int main(int argc, char* argv[]){
 	int openFlags = O_CREAT | O_WRONLY | O_TRUNC;
 	mode_t  filePerms = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
 	int fd2 = open(argv[2] , openFlags, filePerms);
+	if(fd2<0){
+		perror(argv[2]);
+		exit(-3);
+	}
 
-	int num_read;
-	while((num_read=read(fd,buf,COUNT))>0){
+	if(copy_file_fds(fd,fd2,&plan)<0){
 	
-		if(write(fd2,buf,num_read)!=num_read){
-		
-			printf("Write failed\n");
+		printf("Write failed\n");
                 exit(-3);
 
-		}
 	}
+	if(throttle_active(&throttle)) throttle_report(&throttle,stderr);
 
 close(fd);
 close(fd2);
@@ -2,15 +2,18 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include "echo.h"
 
 
 int main(int argc, char* argv[]){
 
-	int i;
-	for(i=1;i<argc;i++){
-	
-		printf("%s  ",argv[i]);
+	EchoLine line;
+	(void)argc;
+	if(echo_build(&line,argv)<0 || echo_write(STDOUT_FILENO,&line)<0){
+		perror("echo");
+		echo_free(&line);
+		return 1;
 	}
-	printf("\n");
+	echo_free(&line);
 	return 0;
 }
@@ -2,16 +2,34 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include "throttle.h"
 
-#define COUNT 100
+#define COUNT (128 * 1024)
 
 int main(int argc, char* argv[]){
-        char buf[COUNT];
+        static char buf[COUNT];
+        double bwlimit=0, iopslimit=0;
+        int nargs=1, used;
+
+        // --bwlimit/--iops-limit may appear anywhere; the rest are files
+        for(int i=1;i<argc;i++){
+                if((used=throttle_option(argv,argc,i,&bwlimit,&iopslimit))>0) i+=used-1;
+                else argv[nargs++]=argv[i];
+        }
+        argc=nargs;
+
         if(argc<3){
-        printf("Usage:  %s file-name\n" ,argv[0]);
+        printf("Usage:  %s [--bwlimit RATE[K|M|G]] [--iops-limit N] file-name target\n" ,argv[0]);
        exit(-1); //that means im waiting for argv[0] esm el barnamg argv[1] dah el argument ely ha2rah
         }
 
+        // Same file system: nothing to copy, so nothing to throttle
+        if(rename(argv[1],argv[2])==0) return 0;
+
+        Throttle throttle=THROTTLE_INIT;
+        throttle_start(&throttle,bwlimit,iopslimit);
+
         int fd=open(argv[1],O_RDONLY);
         if(fd<0){
                 printf("coudlnt open the file\n");
@@ -28,7 +46,7 @@ int main(int argc, char* argv[]){
         exit(-3);
     }
         int num_read;
-        while((num_read=read(fd,buf,COUNT))>0){
+        while((num_read=read(fd,buf,throttle_chunk(&throttle,COUNT)))>0){
 
                 if(write(fd2,buf,num_read)!=num_read){
 
@@ -38,7 +56,9 @@ int main(int argc, char* argv[]){
             exit(-4);
 
                 }
+                throttle_account(&throttle,num_read,num_read,2);
         }
+        if(throttle_active(&throttle)) throttle_report(&throttle,stderr);
 	close(fd);
 	close(fd2);
 if (unlink(argv[1]) != 0) {
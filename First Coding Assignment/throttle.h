@@ -0,0 +1,169 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+// Token-bucket rate limiter behind --bwlimit and --iops-limit, shared by
+// mycp and mymv. The copy loops report every read/write they issue with
+// throttle_account(). --bwlimit caps bytes read and bytes written, each on
+// its own bucket, so a copy moves data at the limit and reads that write
+// nothing (hashing, comparing) are held to it too. Callers run ahead on
+// credit and only sleep once the debt is worth THROTTLE_MIN_SLEEP, so a
+// limited copy does a few long sleeps per second instead of one per chunk.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define THROTTLE_MIN_SLEEP 0.02	// seconds of debt before we sleep
+#define THROTTLE_BURST 0.1	// seconds of unused budget that may be saved up
+
+typedef struct {
+	double rate;		// tokens per second, 0 if unlimited
+	double tokens;		// may go negative: debt paid by sleeping
+	double last;		// time of the last refill
+} TokenBucket;
+
+typedef struct {
+	TokenBucket read;
+	TokenBucket written;
+	TokenBucket ops;
+	pthread_mutex_t lock;	// copy threads share one throttle
+	double start;
+	unsigned long long total_read;
+	unsigned long long total_written;
+	unsigned long long total_ops;
+} Throttle;
+
+// The lock is set up here, once; throttle_start() leaves it alone
+#define THROTTLE_INIT { .lock=PTHREAD_MUTEX_INITIALIZER }
+
+static double throttle_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void bucket_start(TokenBucket *b, double rate, double now){
+	b->rate=rate;
+	b->tokens=0;
+	b->last=now;
+}
+
+// (Re)start with these limits and zeroed totals. Not to be called while
+// other threads use the throttle.
+static void throttle_start(Throttle *t, double bytes_per_sec, double ops_per_sec){
+	t->start=throttle_now();
+	bucket_start(&t->read,bytes_per_sec,t->start);
+	bucket_start(&t->written,bytes_per_sec,t->start);
+	bucket_start(&t->ops,ops_per_sec,t->start);
+	t->total_read=0;
+	t->total_written=0;
+	t->total_ops=0;
+}
+
+static int throttle_active(const Throttle *t){
+	return t->read.rate>0 || t->ops.rate>0;
+}
+
+// Parse "10M", "512K", "1G" or a plain number (K/M/G are powers of 1024).
+// Returns -1 if the value is not a positive number.
+static double throttle_parse(const char *s){
+	char *end;
+	double v=strtod(s,&end);
+	switch(*end){
+	case 'k': case 'K': v*=1024; end++; break;
+	case 'm': case 'M': v*=1024*1024; end++; break;
+	case 'g': case 'G': v*=1024.0*1024*1024; end++; break;
+	}
+	if(end==s || *end!='\0' || v<=0) return -1;
+	return v;
+}
+
+// Spend `amount` tokens; returns how long the caller should sleep
+static double bucket_take(TokenBucket *b, double amount, double now){
+	if(b->rate<=0) return 0;
+	b->tokens+=(now-b->last)*b->rate;
+	b->last=now;
+	if(b->tokens>b->rate*THROTTLE_BURST) b->tokens=b->rate*THROTTLE_BURST;
+	b->tokens-=amount;
+	if(b->tokens>=-b->rate*THROTTLE_MIN_SLEEP) return 0;
+	return -b->tokens/b->rate;
+}
+
+// Record `ops` I/O calls that read `nread` and wrote `nwritten` bytes,
+// sleeping if over the limits
+static void throttle_account(Throttle *t, size_t nread, size_t nwritten, int ops){
+	pthread_mutex_lock(&t->lock);
+	t->total_read+=nread;
+	t->total_written+=nwritten;
+	t->total_ops+=ops;
+	double now=throttle_now();
+	double wait=bucket_take(&t->read,nread,now);
+	double wait_written=bucket_take(&t->written,nwritten,now);
+	double wait_ops=bucket_take(&t->ops,ops,now);
+	pthread_mutex_unlock(&t->lock);
+
+	if(wait_written>wait) wait=wait_written;
+	if(wait_ops>wait) wait=wait_ops;
+	if(wait>0){
+		struct timespec ts={ (time_t)wait, (long)((wait-(time_t)wait)*1e9) };
+		while(nanosleep(&ts,&ts)<0 && errno==EINTR){
+		}
+	}
+}
+
+// Largest chunk worth issuing at once: about THROTTLE_MIN_SLEEP of budget,
+// so a low limit is not exceeded by a single huge request
+static size_t throttle_chunk(const Throttle *t, size_t want){
+	if(t->read.rate<=0) return want;
+	size_t cap=(size_t)(t->read.rate*THROTTLE_MIN_SLEEP);
+	if(cap<4096) cap=4096;
+	return want<cap ? want : cap;
+}
+
+// Print achieved rates next to the limits
+static void throttle_report(Throttle *t, FILE *out){
+	fflush(stdout);	// keep the report after the tool's own messages
+	double secs=throttle_now()-t->start;
+	if(secs<1e-6) secs=1e-6;
+	fprintf(out,"%.1f MB read, %.1f MB written in %.2f s: %.2f / %.2f MB/s",t->total_read/1048576.0,
+		t->total_written/1048576.0,secs,t->total_read/1048576.0/secs,t->total_written/1048576.0/secs);
+	if(t->read.rate>0) fprintf(out," (limit %.2f MB/s each)",t->read.rate/1048576.0);
+	fprintf(out,", %llu I/Os: %.0f IOPS",t->total_ops,t->total_ops/secs);
+	if(t->ops.rate>0) fprintf(out," (limit %.0f IOPS)",t->ops.rate);
+	fprintf(out,"\n");
+}
+
+// Handle --bwlimit=RATE, --bwlimit RATE and the same for --iops-limit.
+// Returns the number of arguments used (0 if argv[i] is something else).
+static int throttle_option(char **argv, int argc, int i, double *bwlimit, double *iopslimit){
+	const char *names[2]={ "--bwlimit", "--iops-limit" };
+	double *targets[2]={ bwlimit, iopslimit };
+
+	for(int k=0;k<2;k++){
+		size_t len=strlen(names[k]);
+		if(strncmp(argv[i],names[k],len)!=0) continue;
+		const char *value;
+		int used;
+		if(argv[i][len]=='='){
+			value=argv[i]+len+1;
+			used=1;
+		}else if(argv[i][len]=='\0' && i+1<argc){
+			value=argv[i+1];
+			used=2;
+		}else{
+			continue;
+		}
+		*targets[k]=throttle_parse(value);
+		if(*targets[k]<0){
+			printf("%s: bad rate '%s'\n",names[k],value);
+			exit(-1);
+		}
+		return used;
+	}
+	return 0;
+}
+
+#endif
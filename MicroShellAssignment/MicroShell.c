@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -5,8 +6,24 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "../First Coding Assignment/echo.h"
 
 #define BUF_SIZE 100000
+#define PROMPT "Nano Shell Prompt > "
 
 typedef struct {
     char *name;
@@ -16,6 +33,102 @@ typedef struct {
 
 ShellVar *variables = NULL;
 int var_count = 0;
+int server_mode = 0; // sessions keep exports private instead of using setenv
+
+// Growable byte buffer, always NUL-terminated once allocated
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+// Destination of a builtin's output: an fd, or a $(...) capture buffer
+typedef struct {
+    int fd;
+    StrBuf *buf;
+} ShellOut;
+
+int sb_reserve(StrBuf *sb, size_t extra) {
+    if (sb->len + extra + 1 <= sb->cap) return 0;
+    size_t cap = sb->cap ? sb->cap : 64;
+    while (cap < sb->len + extra + 1) cap *= 2;
+    char *data = (char *) realloc(sb->data, cap);
+    if (!data) return -1;
+    sb->data = data;
+    sb->cap = cap;
+    return 0;
+}
+
+int sb_append(StrBuf *sb, const char *data, size_t len) {
+    if (sb_reserve(sb, len) < 0) return -1;
+    memcpy(sb->data + sb->len, data, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = (char *) buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const char *p = (const char *) buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int shell_out_write(ShellOut *out, const char *data, size_t len) {
+    if (out->buf) return sb_append(out->buf, data, len);
+    return write_full(out->fd, data, len);
+}
+
+// Server mode: a line's output goes into a pipe that only the event loop
+// drains, so builtins running in the shell itself must not write to it.
+// They append to the session's output queue instead.
+StrBuf *output_queue = NULL;
+int output_pipe = -1;           // read end of that pipe
+struct stat output_pipe_st;     // its write end, as seen on fd 1
+
+// Read whatever is in the output pipe into the queue
+void output_drain(void) {
+    while (sb_reserve(output_queue, 65536) == 0) {
+        ssize_t n = read(output_pipe, output_queue->data + output_queue->len,
+                         output_queue->cap - output_queue->len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        output_queue->len += n;
+        output_queue->data[output_queue->len] = '\0';
+    }
+}
+
+// Where a builtin running in the shell sends its standard output
+ShellOut shell_stdout(void) {
+    ShellOut out = { STDOUT_FILENO, NULL };
+    struct stat st;
+    if (output_queue && fstat(STDOUT_FILENO, &st) == 0 &&
+        st.st_dev == output_pipe_st.st_dev && st.st_ino == output_pipe_st.st_ino) {
+        // Keep it after what was already written to the pipe
+        fflush(stdout);
+        fflush(stderr);
+        output_drain();
+        out.buf = output_queue;
+    }
+    return out;
+}
 
 void set_variable(const char *name, const char *value, int exported) {
     for (int i = 0; i < var_count; i++) {
@@ -24,7 +137,7 @@ void set_variable(const char *name, const char *value, int exported) {
             variables[i].value = strdup(value);
             if (exported) {
                 variables[i].exported = 1;
-                setenv(name, value, 1);
+                if (!server_mode) setenv(name, value, 1);
             }
             return;
         }
@@ -33,7 +146,7 @@ void set_variable(const char *name, const char *value, int exported) {
     variables[var_count].name = strdup(name);
     variables[var_count].value = strdup(value);
     variables[var_count].exported = exported;
-    if (exported) {
+    if (exported && !server_mode) {
         setenv(name, value, 1);
     }
     var_count++;
@@ -52,7 +165,7 @@ void export_variable(const char *name) {
     for (int i = 0; i < var_count; i++) {
         if (strcmp(variables[i].name, name) == 0) {
             variables[i].exported = 1;
-            setenv(variables[i].name, variables[i].value, 1);
+            if (!server_mode) setenv(variables[i].name, variables[i].value, 1);
             return;
         }
     }
@@ -69,130 +182,145 @@ void free_variables() {
     var_count = 0;
 }
 
-// Function to expand variables in a string
-char* expand_variables(const char *input) {
+int capture_command(const char *cmd, StrBuf *out);
+
+// Find the ')' closing a "$(" whose body starts at s; NULL if unterminated
+static const char *find_subst_end(const char *s) {
+    int depth = 1;
+    char quote = 0;
+    for (; *s; s++) {
+        if (quote) {
+            if (*s == quote) quote = 0;
+        } else if (*s == '\'' || *s == '"') {
+            quote = *s;
+        } else if (*s == '(') {
+            depth++;
+        } else if (*s == ')' && --depth == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+// Extend the literal flags (if tracked) to cover the output so far
+static int mark_literal(StrBuf *lit, size_t len, int flag) {
+    if (!lit) return 0;
+    if (sb_reserve(lit, len - lit->len) < 0) return -1;
+    memset(lit->data + lit->len, flag, len - lit->len);
+    lit->len = len;
+    return 0;
+}
+
+// Function to expand variables and command substitutions ($(cmd), `cmd`)
+// in a string. The result is built in one pass; substituted output is read
+// straight into it. Text in single quotes is copied as typed. If literal is
+// not NULL it receives one flag per output byte, set for bytes that came
+// from a substitution: the tokenizer splits those on whitespace only, so
+// output cannot inject quotes, redirections or pipes.
+char* expand_variables(const char *input, unsigned char **literal) {
     if (!input) return NULL;
-    
-    // First, calculate needed buffer size
-    size_t output_size = 1; // Start with 1 for the null terminator
-    char *var_name = NULL;
-    int in_var = 0;
-    size_t var_name_len = 0;
-    
-    for (size_t i = 0; input[i] != '\0'; i++) {
-        if (input[i] == '$' && input[i+1] != '\0' && input[i+1] != ' ') {
-            // Start of variable
-            in_var = 1;
-            var_name_len = 0;
-            var_name = (char *)realloc(var_name, var_name_len + 1);
-            var_name[var_name_len] = '\0';
-        } else if (in_var) {
-            if (input[i] == ' ' || input[i] == '\0' || input[i] == '$' || 
-                input[i] == '/' || input[i] == '>' || input[i] == '<') {
-                // End of variable
-                in_var = 0;
-                var_name[var_name_len] = '\0';
-                char *value = get_variable_value(var_name);
-                output_size += value ? strlen(value) : 0;
-                if (input[i] == '$') {
-                    i--; // Reprocess the $ character
-                } else {
-                    output_size++; // For the delimiter or null
-                }
-            } else {
-                // Inside variable name
-                var_name_len++;
-                var_name = (char *)realloc(var_name, var_name_len + 1);
-                var_name[var_name_len - 1] = input[i];
-                var_name[var_name_len] = '\0';
+
+    StrBuf out = { NULL, 0, 0 };
+    StrBuf lit = { NULL, 0, 0 };
+    StrBuf *lits = literal ? &lit : NULL;
+    if (sb_reserve(&out, strlen(input)) < 0) return NULL;
+    out.data[0] = '\0';
+
+    size_t i = 0;
+    char quote = 0;
+    while (input[i] != '\0') {
+        // Copy plain text in bulk
+        size_t run = strcspn(input + i, quote == '\'' ? "'" : "$`'\"");
+        if (run > 0) {
+            if (sb_append(&out, input + i, run) < 0) goto fail;
+            i += run;
+            continue;
+        }
+
+        if (input[i] == '\'' || input[i] == '"') {
+            if (!quote) {
+                quote = input[i];
+            } else if (quote == input[i]) {
+                quote = 0;
             }
-        } else {
-            // Normal character
-            output_size++;
+            if (sb_append(&out, input + i, 1) < 0) goto fail;
+            i++;
+            continue;
         }
-    }
-    
-    // If we were still processing a variable at the end
-    if (in_var) {
-        var_name[var_name_len] = '\0';
-        char *value = get_variable_value(var_name);
-        output_size += value ? strlen(value) : 0;
-    }
-    
-    // Now create the output string
-    char *output = (char *)malloc(output_size);
-    if (!output) {
-        free(var_name);
-        return NULL;
-    }
-    
-    size_t pos = 0;
-    in_var = 0;
-    var_name_len = 0;
-    
-    for (size_t i = 0; input[i] != '\0'; i++) {
-        if (input[i] == '$' && input[i+1] != '\0' && input[i+1] != ' ') {
-            // Start of variable
-            in_var = 1;
-            var_name_len = 0;
-            var_name = (char *)realloc(var_name, var_name_len + 1);
-            if (!var_name) {
-                free(output);
-                return NULL;
-            }
-            var_name[var_name_len] = '\0';
-        } else if (in_var) {
-            if (input[i] == ' ' || input[i] == '\0' || input[i] == '$' || 
-                input[i] == '/' || input[i] == '>' || input[i] == '<') {
-                // End of variable
-                in_var = 0;
-                var_name[var_name_len] = '\0';
-                char *value = get_variable_value(var_name);
-                if (value) {
-                    strcpy(output + pos, value);
-                    pos += strlen(value);
-                }
-                if (input[i] == '$') {
-                    i--; // Reprocess the $ character
-                } else {
-                    output[pos++] = input[i]; // Copy the delimiter
-                }
-            } else {
-                // Inside variable name
-                var_name_len++;
-                var_name = (char *)realloc(var_name, var_name_len + 1);
-                if (!var_name) {
-                    free(output);
-                    return NULL;
+
+        // Command substitution
+        if (input[i] == '`' || input[i + 1] == '(') {
+            const char *body = input + i + (input[i] == '`' ? 1 : 2);
+            const char *end = input[i] == '`' ? strchr(body, '`') : find_subst_end(body);
+            if (end) {
+                char *cmd = strndup(body, end - body);
+                if (!cmd || mark_literal(lits, out.len, 0) < 0 || capture_command(cmd, &out) < 0 ||
+                    mark_literal(lits, out.len, 1) < 0) {
+                    free(cmd);
+                    goto fail;
                 }
-                var_name[var_name_len - 1] = input[i];
-                var_name[var_name_len] = '\0';
+                free(cmd);
+                i = end + 1 - input;
+                continue;
             }
-        } else {
-            // Normal character
-            output[pos++] = input[i];
+            // Unterminated: keep the text as typed
+            if (sb_append(&out, input + i, 1) < 0) goto fail;
+            i++;
+            continue;
         }
-    }
-    
-    // If we were still processing a variable at the end
-    if (in_var) {
-        var_name[var_name_len] = '\0';
-        char *value = get_variable_value(var_name);
-        if (value) {
-            strcpy(output + pos, value);
-            pos += strlen(value);
+
+        if (input[i] == '$' && input[i+1] != '\0' && input[i+1] != ' ') {
+            // Variable name runs up to the next delimiter, which is kept
+            size_t start = ++i;
+            while (input[i] != '\0' && !strchr(" $/><'\"", input[i])) i++;
+            char *var_name = strndup(input + start, i - start);
+            if (!var_name) goto fail;
+            char *value = get_variable_value(var_name);
+            free(var_name);
+            if (value && sb_append(&out, value, strlen(value)) < 0) goto fail;
+            continue;
         }
+
+        // Lone '$'
+        if (sb_append(&out, input + i, 1) < 0) goto fail;
+        i++;
     }
-    
-    output[pos] = '\0';
-    free(var_name);
-    return output;
+    if (mark_literal(lits, out.len, 0) < 0) goto fail;
+    if (literal) *literal = (unsigned char *) lit.data;
+    return out.data;
+
+fail:
+    free(out.data);
+    free(lit.data);
+    return NULL;
+}
+
+// Operator tokens are these shared strings rather than copies, and are
+// recognized by address: a word that merely spells one (quoted, substituted
+// or matched by a glob) stays a word.
+char op_in[] = "<";
+char op_out[] = ">";
+char op_err[] = "2>";
+char op_pipe[] = "|";
+
+static int is_redirect(const char *token) {
+    return token == op_in || token == op_out || token == op_err;
+}
+
+void free_token(char *token) {
+    if (token && !is_redirect(token) && token != op_pipe) free(token);
 }
 
-// Function to parse command line into tokens, handling quotes and redirection
-char** tokenize_command(char *cmd, int *token_count) {
+// Function to parse command line into tokens, handling quotes and redirection.
+// If quoted_out is not NULL it receives one flag per token, set for quoted
+// tokens (which are not subject to pathname expansion). Bytes flagged in
+// literal (from expand_variables, may be NULL) are ordinary characters.
+char** tokenize_command(char *cmd, const unsigned char *literal, int *token_count, unsigned char **quoted_out) {
     if (!cmd || !token_count) return NULL;
     
+    unsigned char *quoted = NULL;
+    int quoted_len = 0;
+
     int capacity = 10;
     char **tokens = (char**)malloc(capacity * sizeof(char*));
     if (!tokens) return NULL;
@@ -204,8 +332,10 @@ char** tokenize_command(char *cmd, int *token_count) {
     char *token_start = NULL;
     
     while (*current_pos != '\0') {
+        int lit = literal && literal[current_pos - cmd];
+
         // Handle quotes
-        if ((*current_pos == '"' || *current_pos == '\'') && (!quote_char || quote_char == *current_pos)) {
+        if (!lit && (*current_pos == '"' || *current_pos == '\'') && (!quote_char || quote_char == *current_pos)) {
             if (!quote_char) {
                 // Start quoted token
                 quote_char = *current_pos;
@@ -222,13 +352,21 @@ char** tokenize_command(char *cmd, int *token_count) {
                     tokens = (char**)realloc(tokens, capacity * sizeof(char*));
                     if (!tokens) return NULL;
                 }
+                if (quoted_out) {
+                    quoted = (unsigned char *)realloc(quoted, count + 1);
+                    if (!quoted) return NULL;
+                    memset(quoted + quoted_len, 0, count + 1 - quoted_len);
+                    quoted[count] = 1;
+                    quoted_len = count + 1;
+                }
                 tokens[count++] = strdup(token_start);
                 in_token = 0;
             }
         }
         // Handle redirection symbols separately
-        else if (!quote_char && (*current_pos == '<' || *current_pos == '>' || 
-                 (*current_pos == '2' && *(current_pos + 1) == '>'))) {
+        else if (!lit && !quote_char && (*current_pos == '<' || *current_pos == '>' || 
+                 (*current_pos == '2' && *(current_pos + 1) == '>' &&
+                  !(literal && literal[current_pos + 1 - cmd])))) {
             if (in_token) {
                 // End the current token
                 *current_pos = '\0';
@@ -248,22 +386,21 @@ char** tokenize_command(char *cmd, int *token_count) {
                     tokens = (char**)realloc(tokens, capacity * sizeof(char*));
                     if (!tokens) return NULL;
                 }
-                tokens[count++] = strdup("2>");
+                tokens[count++] = op_err;
                 current_pos += 2;
                 continue;
             }
             
             // Add the redirection symbol as a token
-            char symbol[2] = {*current_pos, '\0'};
             if (count >= capacity - 1) {
                 capacity *= 2;
                 tokens = (char**)realloc(tokens, capacity * sizeof(char*));
                 if (!tokens) return NULL;
             }
-            tokens[count++] = strdup(symbol);
+            tokens[count++] = *current_pos == '<' ? op_in : op_out;
         }
-        // Handle spaces
-        else if (!quote_char && *current_pos == ' ') {
+        // Handle spaces (tabs and newlines from $(...) output separate words too)
+        else if (!quote_char && (*current_pos == ' ' || *current_pos == '\t' || *current_pos == '\n')) {
             if (in_token) {
                 // End the current token
                 *current_pos = '\0';
@@ -277,7 +414,7 @@ char** tokenize_command(char *cmd, int *token_count) {
             }
         }
         // Handle pipe symbol
-        else if (!quote_char && *current_pos == '|') {
+        else if (!lit && !quote_char && *current_pos == '|') {
             if (in_token) {
                 // End the current token
                 *current_pos = '\0';
@@ -296,7 +433,7 @@ char** tokenize_command(char *cmd, int *token_count) {
                 tokens = (char**)realloc(tokens, capacity * sizeof(char*));
                 if (!tokens) return NULL;
             }
-            tokens[count++] = strdup("|");
+            tokens[count++] = op_pipe;
         }
         // Handle normal characters
         else {
@@ -322,10 +459,449 @@ char** tokenize_command(char *cmd, int *token_count) {
     // Null-terminate the array
     tokens[count] = NULL;
     *token_count = count;
+
+    if (quoted_out) {
+        quoted = (unsigned char *)realloc(quoted, count + 1);
+        if (!quoted) return NULL;
+        memset(quoted + quoted_len, 0, count + 1 - quoted_len);
+        *quoted_out = quoted;
+    }
     
     return tokens;
 }
 
+// ---------------------------------------------------------------------------
+// Pathname expansion (*, ? and [...]).
+// Each pattern component is compiled into a bit-parallel NFA: bit j of the
+// state means "the first j elements have matched", so a name is matched in
+// one pass over its bytes with no backtracking. Directories are read with
+// getdents64 into a large buffer and matched as they stream in; listings are
+// kept for the rest of the line, up to a byte budget, so a directory named by
+// several globs is read once.
+// ---------------------------------------------------------------------------
+
+#define GLOB_DENTS_BUF (1 << 20)
+#define GLOB_CACHE_BYTES (8 << 20)
+
+typedef struct {
+    int nelem;              // pattern elements; the match state has nelem + 1 bits
+    int nwords;
+    uint64_t *accept;       // [256][nwords]: bit j + 1 set if element j takes the byte
+    uint64_t *stars;        // [nwords]: bits of `*` elements
+    int *star_pos;          // `*` element indexes, ascending
+    int nstars;
+    int dot_ok;             // pattern starts with a literal '.'
+} GlobPattern;
+
+typedef struct {
+    char *dir;              // path prefix as used in results ("" for cwd)
+    char *names;            // d_type byte, name, NUL, repeated
+    size_t len;
+} GlobListing;
+
+typedef struct {
+    GlobListing *listings;
+    int count;
+    size_t bytes;           // cached so far, bounded by GLOB_CACHE_BYTES
+    char *dents;            // getdents64 buffer shared by every scan
+} GlobCache;
+
+typedef struct {
+    char **paths;
+    int count;
+    int capacity;
+} GlobResult;
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+int has_glob_chars(const char *s) {
+    return strpbrk(s, "*?[") != NULL;
+}
+
+static void glob_set(uint64_t *words, int bit) {
+    words[bit / 64] |= (uint64_t) 1 << (bit % 64);
+}
+
+static int glob_test(const uint64_t *words, int bit) {
+    return (words[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void glob_pattern_free(GlobPattern *p) {
+    free(p->accept);
+    free(p->stars);
+    free(p->star_pos);
+}
+
+// Compile one component (no '/') of a glob pattern
+static int glob_compile(const char *pat, size_t len, GlobPattern *p) {
+    memset(p, 0, sizeof(*p));
+    p->nwords = (int) ((len + 1) / 64 + 1); // at most one element per byte
+    p->accept = (uint64_t *) calloc(256 * (size_t) p->nwords, sizeof(uint64_t));
+    p->stars = (uint64_t *) calloc(p->nwords, sizeof(uint64_t));
+    p->star_pos = (int *) malloc((len + 1) * sizeof(int));
+    if (!p->accept || !p->stars || !p->star_pos) {
+        glob_pattern_free(p);
+        return -1;
+    }
+    p->dot_ok = len > 0 && pat[0] == '.';
+
+    size_t i = 0;
+    while (i < len) {
+        int e = p->nelem++;
+        unsigned char c = pat[i];
+
+        if (c == '*') {
+            glob_set(p->stars, e);
+            p->star_pos[p->nstars++] = e;
+            while (i < len && pat[i] == '*') i++; // `**` is the same as `*`
+            continue;
+        }
+        if (c == '?') {
+            for (int b = 1; b < 256; b++) glob_set(p->accept + b * p->nwords, e + 1);
+            i++;
+            continue;
+        }
+        if (c == '[') {
+            // Find the closing bracket; a leading ']' (after any '!'/'^') is literal
+            size_t j = i + 1;
+            int negate = j < len && (pat[j] == '!' || pat[j] == '^');
+            if (negate) j++;
+            size_t first = j;
+            if (j < len && pat[j] == ']') j++;
+            while (j < len && pat[j] != ']') j++;
+            if (j < len) {
+                unsigned char set[256] = { 0 };
+                for (size_t k = first; k < j; k++) {
+                    unsigned char lo = pat[k];
+                    if (k + 2 < j && pat[k + 1] == '-') {
+                        unsigned char hi = pat[k + 2];
+                        for (int b = lo; b <= hi; b++) set[b] = 1;
+                        k += 2;
+                    } else {
+                        set[lo] = 1;
+                    }
+                }
+                for (int b = 1; b < 256; b++) {
+                    if (set[b] != negate && b != '/') glob_set(p->accept + b * p->nwords, e + 1);
+                }
+                i = j + 1;
+                continue;
+            }
+            // Unterminated '[' is an ordinary character
+        }
+        if (c == '\\' && i + 1 < len) {
+            c = pat[++i];
+        }
+        glob_set(p->accept + c * p->nwords, e + 1);
+        i++;
+    }
+    return 0;
+}
+
+// Follow the empty transitions out of `*` elements
+static void glob_closure(const GlobPattern *p, uint64_t *state) {
+    for (int k = 0; k < p->nstars; k++) {
+        if (glob_test(state, p->star_pos[k])) glob_set(state, p->star_pos[k] + 1);
+    }
+}
+
+static int glob_match(const GlobPattern *p, const char *name) {
+    if (name[0] == '.') {
+        if (!p->dot_ok) return 0;
+        if (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')) return 0;
+    }
+
+    uint64_t state[p->nwords];
+    memset(state, 0, sizeof(state));
+    glob_set(state, 0);
+    glob_closure(p, state);
+
+    for (const unsigned char *s = (const unsigned char *) name; *s; s++) {
+        const uint64_t *acc = p->accept + *s * p->nwords;
+        uint64_t carry = 0, live = 0;
+        for (int w = 0; w < p->nwords; w++) {
+            uint64_t shifted = (state[w] << 1) | carry;
+            carry = state[w] >> 63;
+            state[w] = (shifted & acc[w]) | (state[w] & p->stars[w]);
+            live |= state[w];
+        }
+        if (!live) return 0;
+        glob_closure(p, state);
+    }
+    return glob_test(state, p->nelem);
+}
+
+static void glob_result_add(GlobResult *r, char *path) {
+    if (r->count == r->capacity) {
+        r->capacity = r->capacity ? r->capacity * 2 : 16;
+        r->paths = (char **) realloc(r->paths, r->capacity * sizeof(char *));
+    }
+    r->paths[r->count++] = path;
+}
+
+static char *glob_join(const char *dir, const char *name, const char *suffix) {
+    size_t dlen = strlen(dir), nlen = strlen(name), slen = strlen(suffix);
+    char *path = (char *) malloc(dlen + nlen + slen + 1);
+    if (path) {
+        memcpy(path, dir, dlen);
+        memcpy(path + dlen, name, nlen);
+        memcpy(path + dlen + nlen, suffix, slen + 1);
+    }
+    return path;
+}
+
+static int glob_is_dir(const char *dir, const char *name, unsigned char type) {
+    if (type == DT_DIR) return 1;
+    if (type != DT_LNK && type != DT_UNKNOWN) return 0;
+    char *path = glob_join(dir, name, "");
+    struct stat st;
+    int is_dir = path && stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    free(path);
+    return is_dir;
+}
+
+static void glob_expand_from(GlobCache *cache, const char *dir, char **comps, int ncomps,
+                             GlobResult *out);
+
+// Match one listed entry and carry on with the remaining components
+static void glob_visit(GlobCache *cache, const char *dir, const GlobPattern *p,
+                       const char *name, unsigned char type, char **comps, int ncomps,
+                       GlobResult *out) {
+    if (!glob_match(p, name)) return;
+    if (ncomps == 1) {
+        char *path = glob_join(dir, name, "");
+        if (path) glob_result_add(out, path);
+        return;
+    }
+    if (!glob_is_dir(dir, name, type)) return;
+    char *sub = glob_join(dir, name, "/");
+    if (sub) {
+        glob_expand_from(cache, sub, comps + 1, ncomps - 1, out);
+        free(sub);
+    }
+}
+
+// List `dir` (cached or via getdents64) and match comps[0] against it
+static void glob_scan(GlobCache *cache, const char *dir, const GlobPattern *p,
+                      char **comps, int ncomps, GlobResult *out) {
+    for (int i = 0; i < cache->count; i++) {
+        GlobListing *l = &cache->listings[i];
+        if (strcmp(l->dir, dir) == 0) {
+            // Recursing may grow cache->listings, so do not hold on to `l`
+            const char *names = l->names;
+            size_t len = l->len;
+            for (size_t off = 0; off < len; off += strlen(names + off + 1) + 2) {
+                glob_visit(cache, dir, p, names + off + 1, (unsigned char) names[off],
+                           comps, ncomps, out);
+            }
+            return;
+        }
+    }
+
+    int fd = open(dir[0] ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    if (!cache->dents) cache->dents = (char *) malloc(GLOB_DENTS_BUF);
+    if (!cache->dents) {
+        close(fd);
+        return;
+    }
+
+    // Keep the listing while it fits in the line's budget
+    GlobListing listing = { NULL, NULL, 0 };
+    size_t listing_cap = 0;
+    int cacheable = 1;
+
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, cache->dents, GLOB_DENTS_BUF)) > 0) {
+        // Matching may recurse into subdirectories and reuse the buffer,
+        // so walk this batch from a private copy only when that can happen
+        char *batch = cache->dents;
+        char *copy = NULL;
+        if (ncomps > 1) {
+            copy = (char *) malloc(n);
+            if (!copy) break;
+            memcpy(copy, cache->dents, n);
+            batch = copy;
+        }
+        for (long off = 0; off < n;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *) (batch + off);
+            off += d->d_reclen;
+
+            if (cacheable) {
+                size_t need = strlen(d->d_name) + 2;
+                char *grown = listing.names;
+                if (cache->bytes + listing.len + need > GLOB_CACHE_BYTES) {
+                    grown = NULL; // too big to keep: stream the rest
+                } else if (listing.len + need > listing_cap) {
+                    listing_cap = (listing_cap + need) * 2;
+                    grown = (char *) realloc(listing.names, listing_cap);
+                }
+                if (!grown) {
+                    cacheable = 0;
+                    free(listing.names);
+                    listing.names = NULL;
+                } else {
+                    listing.names = grown;
+                    listing.names[listing.len] = (char) d->d_type;
+                    memcpy(listing.names + listing.len + 1, d->d_name, need - 1);
+                    listing.len += need;
+                }
+            }
+            glob_visit(cache, dir, p, d->d_name, d->d_type, comps, ncomps, out);
+        }
+        free(copy);
+    }
+    close(fd);
+
+    if (n == 0 && cacheable) {
+        GlobListing *grown = (GlobListing *) realloc(cache->listings, (cache->count + 1) * sizeof(GlobListing));
+        listing.dir = strdup(dir);
+        if (grown && listing.dir) {
+            cache->listings = grown;
+            cache->listings[cache->count++] = listing;
+            cache->bytes += listing.len;
+            return;
+        }
+        if (grown) cache->listings = grown;
+        free(listing.dir);
+    }
+    free(listing.names);
+}
+
+static void glob_expand_from(GlobCache *cache, const char *dir, char **comps, int ncomps,
+                             GlobResult *out) {
+    // A trailing '/' in the pattern only keeps directories
+    if (ncomps == 1 && comps[0][0] == '\0') {
+        struct stat st;
+        if (stat(dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+            char *path = strdup(dir);
+            if (path) glob_result_add(out, path);
+        }
+        return;
+    }
+
+    if (!has_glob_chars(comps[0])) {
+        // Literal component: no listing needed, just check it at the end
+        char *path = glob_join(dir, comps[0], ncomps > 1 ? "/" : "");
+        if (!path) return;
+        if (ncomps > 1) {
+            glob_expand_from(cache, path, comps + 1, ncomps - 1, out);
+            free(path);
+        } else {
+            struct stat st;
+            if (lstat(path, &st) == 0) {
+                glob_result_add(out, path);
+            } else {
+                free(path);
+            }
+        }
+        return;
+    }
+
+    GlobPattern p;
+    if (glob_compile(comps[0], strlen(comps[0]), &p) < 0) return;
+    glob_scan(cache, dir, &p, comps, ncomps, out);
+    glob_pattern_free(&p);
+}
+
+static int glob_compare(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Expand one word; returns the number of matches added to `out`
+int glob_word(GlobCache *cache, const char *word, GlobResult *out) {
+    char *copy = strdup(word);
+    if (!copy) return 0;
+
+    int ncomps = 1;
+    for (char *c = copy; *c; c++) ncomps += *c == '/';
+    char **comps = (char **) malloc(ncomps * sizeof(char *));
+    if (!comps) {
+        free(copy);
+        return 0;
+    }
+    ncomps = 0;
+    char *start = copy;
+    const char *root = "";
+    if (*start == '/') {
+        root = "/";
+        while (*start == '/') start++;
+    }
+    for (char *c = start;; c++) {
+        if (*c == '/' || *c == '\0') {
+            int end = *c == '\0';
+            *c = '\0';
+            comps[ncomps++] = start;
+            if (end) break;
+            while (c[1] == '/') c++;
+            start = c + 1;
+        }
+    }
+
+    int before = out->count;
+    glob_expand_from(cache, root, comps, ncomps, out);
+    int added = out->count - before;
+
+    // Sort only when the matches did not come out in order already
+    for (int i = before + 1; i < out->count; i++) {
+        if (strcmp(out->paths[i - 1], out->paths[i]) > 0) {
+            qsort(out->paths + before, added, sizeof(char *), glob_compare);
+            break;
+        }
+    }
+
+    free(comps);
+    free(copy);
+    return added;
+}
+
+void glob_cache_free(GlobCache *cache) {
+    for (int i = 0; i < cache->count; i++) {
+        free(cache->listings[i].dir);
+        free(cache->listings[i].names);
+    }
+    free(cache->listings);
+    free(cache->dents);
+}
+
+// Replace unquoted glob words in a token list with their sorted matches.
+// Words without matches, redirection targets and quoted words are kept as is.
+int expand_globs(char ***tokens_p, int *token_count, const unsigned char *quoted) {
+    char **tokens = *tokens_p;
+    int i;
+
+    for (i = 0; i < *token_count; i++) {
+        if (!(quoted && quoted[i]) && has_glob_chars(tokens[i])) break;
+    }
+    if (i == *token_count) return 0;
+
+    GlobCache cache = { NULL, 0, 0, NULL };
+    GlobResult out = { NULL, 0, 0 };
+
+    for (i = 0; i < *token_count; i++) {
+        int is_target = i > 0 && is_redirect(tokens[i - 1]);
+        if (!is_target && !(quoted && quoted[i]) && has_glob_chars(tokens[i]) &&
+            glob_word(&cache, tokens[i], &out) > 0) {
+            free(tokens[i]);
+            continue;
+        }
+        glob_result_add(&out, tokens[i]);
+    }
+    glob_cache_free(&cache);
+
+    glob_result_add(&out, NULL);
+    free(tokens);
+    *tokens_p = out.paths;
+    *token_count = out.count - 1;
+    return 0;
+}
+
 // Function to extract command args (excluding redirection operators and their targets)
 char** extract_command_args(char **tokens, int token_count, int *new_count) {
     if (!tokens || !new_count) return NULL;
@@ -337,9 +913,7 @@ char** extract_command_args(char **tokens, int token_count, int *new_count) {
     
     for (int i = 0; i < token_count && tokens[i] != NULL; i++) {
         // Skip redirection operators and their filenames
-        if (strcmp(tokens[i], "<") == 0 || 
-            strcmp(tokens[i], ">") == 0 || 
-            strcmp(tokens[i], "2>") == 0) {
+        if (is_redirect(tokens[i])) {
             if (i + 1 < token_count && tokens[i+1] != NULL) {
                 i++; // Skip the filename too
             }
@@ -369,7 +943,7 @@ int setup_redirection(char **tokens, int token_count, int in_parent) {
     
     // First, identify and validate all redirections
     for (int i = 0; i < token_count && tokens[i] != NULL; i++) {
-        if (strcmp(tokens[i], ">") == 0) {
+        if (tokens[i] == op_out) {
             flag=1;
             if (i + 1 >= token_count || tokens[i+1] == NULL) {
                 fprintf(stderr, "syntax error near unexpected token `>'\n");
@@ -403,7 +977,7 @@ int setup_redirection(char **tokens, int token_count, int in_parent) {
             i++; // Skip the filename
         }
         // Input redirection
-        if (strcmp(tokens[i], "<") == 0) {
+        if (tokens[i] == op_in) {
             if (i + 1 >= token_count || tokens[i+1] == NULL) {
                 fprintf(stderr, "syntax error near unexpected token `<'\n");
                 success = 0;
@@ -421,7 +995,7 @@ int setup_redirection(char **tokens, int token_count, int in_parent) {
         // Output redirection
         
         // Error redirection
-        else if (strcmp(tokens[i], "2>") == 0) {
+        else if (tokens[i] == op_err) {
             if (i + 1 >= token_count || tokens[i+1] == NULL) {
                 fprintf(stderr, "syntax error near unexpected token `2>'\n");
                 success = 0;
@@ -474,7 +1048,7 @@ int setup_redirection(char **tokens, int token_count, int in_parent) {
     
     // First handle stderr redirection to capture any errors in other redirections
     for (int i = 0; i < token_count && tokens[i] != NULL && success; i++) {
-        if (strcmp(tokens[i], "2>") == 0) {
+        if (tokens[i] == op_err) {
             if (i + 1 >= token_count || tokens[i+1] == NULL) {
                 // This shouldn't happen as we've already validated
                 success = 0;
@@ -502,7 +1076,7 @@ int setup_redirection(char **tokens, int token_count, int in_parent) {
     
     // Now handle input redirection
     for (int i = 0; i < token_count && tokens[i] != NULL && success; i++) {
-        if (strcmp(tokens[i], "<") == 0) {
+        if (tokens[i] == op_in) {
             if (i + 1 >= token_count || tokens[i+1] == NULL) {
                 // This shouldn't happen as we've already validated
                 success = 0;
@@ -534,7 +1108,7 @@ int setup_redirection(char **tokens, int token_count, int in_parent) {
     
     // Finally handle output redirection
     for (int i = 0; i < token_count && tokens[i] != NULL && success; i++) {
-        if (strcmp(tokens[i], ">") == 0) {
+        if (tokens[i] == op_out) {
             if (i + 1 >= token_count || tokens[i+1] == NULL) {
                 // This shouldn't happen as we've already validated
                 success = 0;
@@ -573,224 +1147,2039 @@ int setup_redirection(char **tokens, int token_count, int in_parent) {
     
     return success;
 }
-int microshell_main(int argc, char *argv[]) {
-    char buf[BUF_SIZE];
-    pid_t pid;
-    int last_status = 0;
-    int has_error = 0;
+// ---------------------------------------------------------------------------
+// CPU and memory placement of launched commands. MSH_CPUSET (a cpu list such
+// as 0-7,16) limits the CPUs commands may use. MSH_PLACEMENT picks how they
+// are spread over those CPUs: `roundrobin` gives each command (or pipeline
+// stage) the next single CPU, `node` the next NUMA node's CPUs, and `none`
+// gives every command the whole set. `pin CPULIST cmd` overrides both for one
+// command. The child applies its placement with sched_setaffinity() and
+// set_mempolicy() before exec, so memory comes from the nodes of its CPUs.
+// ---------------------------------------------------------------------------
 
-    while (1) {
-        printf("Nano Shell Prompt > ");
-        fflush(stdout);
+#define MAX_NODES 64
+#define MPOL_PREFERRED 1
+#define MPOL_PREFERRED_MANY 5   // Linux 5.15+
 
-        if (fgets(buf, BUF_SIZE, stdin) == NULL) {
-            break;
+typedef struct {
+    int active;             // 0: inherit the shell's placement
+    cpu_set_t cpus;
+    uint64_t nodes;         // NUMA nodes of those CPUs
+} Placement;
+
+static short cpu_node[CPU_SETSIZE];
+static int numa_nodes = 0;  // 0 until read from /sys
+static unsigned placement_counter = 0;
+
+// Parse a cpu list like "0-3,8,10-11" (trailing newline allowed)
+int parse_cpulist(const char *s, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*s && *s != '\n') {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s || lo < 0) return -1;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo) return -1;
         }
+        if (hi >= CPU_SETSIZE) return -1;
+        for (long c = lo; c <= hi; c++) CPU_SET(c, set);
+        s = end;
+        if (*s == ',') s++;
+        else if (*s && *s != '\n') return -1;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
 
-        buf[strcspn(buf, "\n")] = 0;  // remove newline
+// The inverse of parse_cpulist(), using ranges where possible
+void format_cpulist(const cpu_set_t *set, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int c = 0; c < CPU_SETSIZE && len < size; c++) {
+        if (!CPU_ISSET(c, set)) continue;
+        int hi = c;
+        while (hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, set)) hi++;
+        len += snprintf(buf + len, size - len, hi > c ? "%s%d-%d" : "%s%d", len ? "," : "", c, hi);
+        c = hi;
+    }
+}
 
-        if (strlen(buf) == 0) continue;
+// Map CPUs to NUMA nodes from /sys; without it everything is node 0
+static void numa_load(void) {
+    if (numa_nodes > 0) return;
+    numa_nodes = 1;
+    for (int node = 0; node < MAX_NODES; node++) {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        ssize_t n = read(fd, list, sizeof(list) - 1);
+        close(fd);
+        cpu_set_t set;
+        if (n <= 0) continue;
+        list[n] = '\0';
+        if (parse_cpulist(list, &set) < 0) continue;
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &set)) cpu_node[c] = node;
+        }
+        if (node + 1 > numa_nodes) numa_nodes = node + 1;
+    }
+}
 
-        // Check for assignment (exactly: name=value)
-        char *eq = strchr(buf, '=');
-        if (eq != NULL && eq != buf && !strchr(buf, ' ')) {
-            *eq = '\0';
-            char *name = buf;
-            char *value = eq + 1;
-            set_variable(name, value, 0);
-            last_status = 0;
-            continue;
+// Left empty on a single-node machine, where there is no memory policy to set
+static void placement_set_nodes(Placement *p) {
+    numa_load();
+    p->nodes = 0;
+    if (numa_nodes < 2) return;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &p->cpus)) p->nodes |= 1ULL << cpu_node[c];
+    }
+}
+
+// Placement for `pin CPULIST`
+int placement_pin(const char *list, Placement *p) {
+    if (parse_cpulist(list, &p->cpus) < 0) return -1;
+    p->active = 1;
+    placement_set_nodes(p);
+    return 0;
+}
+
+// Placement for the next command under MSH_CPUSET and MSH_PLACEMENT
+void placement_next(Placement *p) {
+    const char *list = get_variable_value("MSH_CPUSET");
+    const char *policy = get_variable_value("MSH_PLACEMENT");
+    cpu_set_t pool;
+
+    p->active = 0;
+    if (policy && strcmp(policy, "none") == 0) policy = NULL;
+    if (!policy && !(list && *list)) return;
+
+    if (list && *list) {
+        if (parse_cpulist(list, &pool) < 0) {
+            fprintf(stderr, "MSH_CPUSET: bad cpu list '%s'\n", list);
+            return;
         }
+    } else if (sched_getaffinity(0, sizeof(pool), &pool) < 0) {
+        return;
+    }
 
-        // Expand variables in the entire command line first
-        char *expanded_buf = expand_variables(buf);
-        if (!expanded_buf) {
-            fprintf(stderr, "Memory allocation error\n");
-            last_status = 1;
-            has_error = 1;
-            continue;
+    CPU_ZERO(&p->cpus);
+    if (!policy) {
+        p->cpus = pool;
+    } else if (strcmp(policy, "roundrobin") == 0) {
+        int pick = placement_counter++ % CPU_COUNT(&pool);
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &pool) && pick-- == 0) {
+                CPU_SET(c, &p->cpus);
+                break;
+            }
         }
-        
-        // Tokenize the command
-        int token_count = 0;
-        char **tokens = tokenize_command(expanded_buf, &token_count);
-        if (!tokens || token_count == 0) {
-            free(expanded_buf);
-            if (tokens) free(tokens);
-            continue;
+    } else if (strcmp(policy, "node") == 0) {
+        // Next node, counting only nodes that have CPUs in the pool
+        numa_load();
+        uint64_t used = 0;
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &pool)) used |= 1ULL << cpu_node[c];
         }
-        
-        // Extract command arguments (excluding redirection tokens)
-        int cmd_count = 0;
-        char **cmd_args = extract_command_args(tokens, token_count, &cmd_count);
-        if (!cmd_args || cmd_count == 0) {
-            for (int i = 0; i < token_count; i++) {
-                if (tokens[i]) free(tokens[i]);
-            }
-            free(tokens);
-            free(expanded_buf);
-            continue;
+        int pick = placement_counter++ % __builtin_popcountll(used), node = 0;
+        while (!(used & (1ULL << node)) || pick-- > 0) node++;
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &pool) && cpu_node[c] == node) CPU_SET(c, &p->cpus);
         }
-        
-        // Save original file descriptors
-        int original_stdin = dup(STDIN_FILENO);
-        int original_stdout = dup(STDOUT_FILENO);
-        int original_stderr = dup(STDERR_FILENO);
-        
-        // Handle built-in commands
-        if (strcmp(cmd_args[0], "pwd") == 0) {
-            // Validate redirections first, but don't perform them yet
-            if (!setup_redirection(tokens, token_count, 1)) {
-                last_status = 1;
-                has_error = 1;
-            } else {
-                // Now actually perform redirections
-                if (setup_redirection(tokens, token_count, 0)) {
-                    char cwd[BUF_SIZE];
-                    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-                        printf("%s\n", cwd);
-                        last_status = 0;
-                    } else {
-                        perror("pwd");
-                        last_status = 1;
-                        has_error = 1;
-                    }
-                } else {
-                    // This should never happen since we already validated
-                    last_status = 1;
-                    has_error = 1;
-                }
+    } else {
+        fprintf(stderr, "MSH_PLACEMENT: unknown policy '%s' (roundrobin, node or none)\n", policy);
+        return;
+    }
+    p->active = 1;
+    placement_set_nodes(p);
+}
+
+// Apply a placement to the calling process; runs in the child before exec
+static void placement_apply(const Placement *p) {
+    if (!p->active) return;
+    if (sched_setaffinity(0, sizeof(p->cpus), &p->cpus) < 0) {
+        perror("sched_setaffinity");
+    }
+    // Prefer memory on the CPUs' own nodes
+    if (p->nodes) {
+        unsigned long mask = p->nodes;
+        int first = __builtin_ctzll(p->nodes);
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED_MANY, &mask, sizeof(mask) * 8 + 1) < 0) {
+            mask = 1UL << first;
+            if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1) < 0) {
+                perror("set_mempolicy");
             }
-        } else if (strcmp(cmd_args[0], "echo") == 0) {
-            // Validate redirections first, but don't perform them yet
-            if (!setup_redirection(tokens, token_count, 1)) {
-                last_status = 1;
-                has_error = 1;
-            } else {
-                // Now actually perform redirections
-                if (setup_redirection(tokens, token_count, 0)) {
-                    // Output the echo arguments
-                    for (int j = 1; cmd_args[j] != NULL; j++) {
-                        printf("%s", cmd_args[j]);
-                        if (cmd_args[j + 1] != NULL) printf(" ");
-                    }
-                    printf("\n");
-                    fflush(stdout);
-                    last_status = 0;
-                } else {
-                    // This should never happen since we already validated
-                    last_status = 1;
-                    has_error = 1;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Zygote: a helper forked before the shell grows, which launches commands on
+// the shell's behalf so each fork copies the helper's small address space
+// instead of the shell's. Requests carry argv, envp and the placement, plus stdin,
+// stdout, stderr and the working directory as fds (SCM_RIGHTS). The zygote
+// replies with the child's pid once it is running and with its wait status
+// and resource usage when it exits, since only the zygote can reap it.
+// ---------------------------------------------------------------------------
+
+#define ZYGOTE_FDS 4 // stdin, stdout, stderr, cwd
+
+enum { ZYGOTE_SPAWNED, ZYGOTE_EXITED };
+
+typedef struct {
+    int argc;
+    int envc;
+    size_t len;             // bytes of NUL-separated strings that follow
+    Placement placement;
+} ZygoteRequest;
+
+typedef struct {
+    int type;
+    pid_t pid;              // -1 if fork failed
+    int status;             // wait status, or errno for a failed spawn
+    struct rusage usage;    // of an exited command
+} ZygoteReply;
+
+int zygote_fd = -1;
+
+// Exit reports read while waiting for something else
+ZygoteReply *zygote_stash = NULL;
+int zygote_stash_count = 0;
+
+static void zygote_launch(int sock, int *fds, char *strings, int argc, int envc, const Placement *placement) {
+    char **child_argv = (char **) malloc((argc + 1) * sizeof(char *));
+    char **child_envp = (char **) malloc((envc + 1) * sizeof(char *));
+    ZygoteReply reply = { .type = ZYGOTE_SPAWNED, .pid = -1 };
+
+    if (child_argv && child_envp && argc > 0) {
+        char *p = strings;
+        for (int i = 0; i < argc; i++, p += strlen(p) + 1) child_argv[i] = p;
+        for (int i = 0; i < envc; i++, p += strlen(p) + 1) child_envp[i] = p;
+        child_argv[argc] = NULL;
+        child_envp[envc] = NULL;
+
+        reply.pid = fork();
+        if (reply.pid == 0) {
+            sigset_t none;
+            sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, NULL);
+            signal(SIGPIPE, SIG_DFL);
+            dup2(fds[0], STDIN_FILENO);
+            dup2(fds[1], STDOUT_FILENO);
+            dup2(fds[2], STDERR_FILENO);
+            if (fchdir(fds[3]) != 0) {
+                perror("fchdir");
+            }
+            placement_apply(placement);
+            environ = child_envp;
+            execvp(child_argv[0], child_argv);
+            fprintf(stderr, "%s: command not found\n", child_argv[0]);
+            _exit(127);
+        }
+        if (reply.pid < 0) reply.status = errno;
+    } else {
+        reply.status = EINVAL;
+    }
+
+    free(child_argv);
+    free(child_envp);
+    write_full(sock, &reply, sizeof(reply));
+}
+
+static void zygote_loop(int sock) {
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    int sfd = signalfd(-1, &chld, SFD_CLOEXEC);
+
+    struct pollfd pfds[2] = {
+        { .fd = sock, .events = POLLIN },
+        { .fd = sfd, .events = POLLIN },
+    };
+
+    while (1) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            _exit(1);
+        }
+
+        if (pfds[1].revents) {
+            struct signalfd_siginfo info;
+            if (read(sfd, &info, sizeof(info)) < 0) {
+                // Nothing to do; reap below anyway
+            }
+            ZygoteReply reply = { .type = ZYGOTE_EXITED };
+            while ((reply.pid = wait4(-1, &reply.status, WNOHANG, &reply.usage)) > 0) {
+                write_full(sock, &reply, sizeof(reply));
+            }
+        }
+
+        if (pfds[0].revents) {
+            ZygoteRequest req;
+            char control[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+            struct iovec iov = { &req, sizeof(req) };
+            struct msghdr msg = { 0 };
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            ssize_t n = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+            if (n <= 0) _exit(0); // shell went away
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            if (n != sizeof(req) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+                cmsg->cmsg_len != CMSG_LEN(ZYGOTE_FDS * sizeof(int))) {
+                _exit(1);
+            }
+            int fds[ZYGOTE_FDS];
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+            char *strings = (char *) malloc(req.len + 1);
+            if (!strings || read_full(sock, strings, req.len) < 0) _exit(1);
+            strings[req.len] = '\0';
+
+            zygote_launch(sock, fds, strings, req.argc, req.envc, &req.placement);
+
+            free(strings);
+            for (int i = 0; i < ZYGOTE_FDS; i++) close(fds[i]);
+        }
+    }
+}
+
+// Fork the zygote. Call early, while the shell is still small.
+int zygote_start(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("zygote");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        zygote_loop(sv[1]);
+        _exit(0);
+    }
+    close(sv[1]);
+    zygote_fd = sv[0];
+    return 0;
+}
+
+static int zygote_read_reply(ZygoteReply *reply) {
+    if (read_full(zygote_fd, reply, sizeof(*reply)) < 0) {
+        fprintf(stderr, "zygote: helper exited, launching directly\n");
+        close(zygote_fd);
+        zygote_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void zygote_stash_push(ZygoteReply *reply) {
+    zygote_stash = (ZygoteReply *) realloc(zygote_stash, (zygote_stash_count + 1) * sizeof(ZygoteReply));
+    zygote_stash[zygote_stash_count++] = *reply;
+}
+
+// Pop an exit report read earlier. Returns 0 if there is none.
+int zygote_take_stashed(pid_t pid, ZygoteReply *reply) {
+    for (int i = 0; i < zygote_stash_count; i++) {
+        if (pid == -1 || zygote_stash[i].pid == pid) {
+            *reply = zygote_stash[i];
+            zygote_stash[i] = zygote_stash[--zygote_stash_count];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Launch argv through the zygote with the shell's current stdio and cwd.
+// The environment is the process environment plus the exported variables.
+pid_t zygote_spawn(char **argv, const Placement *placement) {
+    size_t len = 0;
+    int argc = 0, envc = 0;
+    char **env = environ;
+
+    for (; argv[argc]; argc++) len += strlen(argv[argc]) + 1;
+    for (int i = 0; env[i]; i++) len += strlen(env[i]) + 1;
+    for (int j = 0; j < var_count; j++) {
+        if (variables[j].exported) {
+            len += strlen(variables[j].name) + strlen(variables[j].value) + 2;
+        }
+    }
+
+    char *strings = (char *) malloc(len);
+    if (!strings) return -1;
+    char *p = strings;
+    for (int i = 0; i < argc; i++) p = stpcpy(p, argv[i]) + 1;
+    for (int i = 0; env[i]; i++) {
+        // Exported shell variables take precedence over inherited ones
+        int overridden = 0;
+        for (int j = 0; j < var_count && !overridden; j++) {
+            size_t nlen = strlen(variables[j].name);
+            overridden = variables[j].exported && strncmp(env[i], variables[j].name, nlen) == 0 &&
+                         env[i][nlen] == '=';
+        }
+        if (!overridden) {
+            p = stpcpy(p, env[i]) + 1;
+            envc++;
+        }
+    }
+    for (int j = 0; j < var_count; j++) {
+        if (variables[j].exported) {
+            p = stpcpy(stpcpy(stpcpy(p, variables[j].name), "="), variables[j].value) + 1;
+            envc++;
+        }
+    }
+
+    ZygoteRequest req = { argc, envc, (size_t) (p - strings), *placement };
+    int cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int fds[ZYGOTE_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd_fd };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { &req, sizeof(req) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int sent = cwd_fd >= 0 && sendmsg(zygote_fd, &msg, 0) == sizeof(req) &&
+               write_full(zygote_fd, strings, req.len) == 0;
+    if (cwd_fd >= 0) close(cwd_fd);
+    free(strings);
+    if (!sent) {
+        perror("zygote");
+        return -1;
+    }
+
+    ZygoteReply reply;
+    while (zygote_read_reply(&reply) == 0) {
+        if (reply.type == ZYGOTE_SPAWNED) {
+            if (reply.pid < 0) errno = reply.status;
+            return reply.pid;
+        }
+        zygote_stash_push(&reply);
+    }
+    return -1;
+}
+
+// wait4() for a command launched through the zygote
+pid_t zygote_wait(pid_t pid, int *status, struct rusage *usage) {
+    ZygoteReply reply;
+    if (zygote_take_stashed(pid, &reply)) {
+        *status = reply.status;
+        *usage = reply.usage;
+        return pid;
+    }
+    while (zygote_fd >= 0 && zygote_read_reply(&reply) == 0) {
+        if (reply.type == ZYGOTE_EXITED && reply.pid == pid) {
+            *status = reply.status;
+            *usage = reply.usage;
+            return pid;
+        }
+        zygote_stash_push(&reply);
+    }
+    return -1;
+}
+
+// wait4() for a command started by run_tokens(), with or without the zygote
+pid_t wait_command(pid_t pid, int *status, struct rusage *usage) {
+    if (zygote_fd >= 0) return zygote_wait(pid, status, usage);
+    pid_t r;
+    while ((r = wait4(pid, status, 0, usage)) < 0 && errno == EINTR) {
+    }
+    return r;
+}
+
+// Fold a wait status into the shell's status flags
+void record_exit_status(int status, int *last_status, int *has_error) {
+    if (WIFEXITED(status)) {
+        *last_status = WEXITSTATUS(status);
+        if (*last_status != 0) {
+            *has_error = 1;
+        }
+    } else {
+        *last_status = 1;
+        *has_error = 1;
+    }
+}
+
+// Per-command statistics for the `stats` builtin: where each external command
+// was placed, and its wall time and resource usage from wait4()
+#define STATS_KEPT 32
+
+typedef struct {
+    pid_t pid;
+    char name[32];
+    char cpus[48];          // cpu list it was placed on, "-" if it inherited the shell's
+    char nodes[24];         // memory nodes it preferred, "-" if none were set
+    double start;           // CLOCK_MONOTONIC seconds
+    double end;
+    int status;
+    struct rusage usage;
+} CommandStat;
+
+typedef struct {
+    CommandStat entries[STATS_KEPT]; // the last STATS_KEPT commands, as a ring
+    int count;
+} StatLog;
+
+StatLog shell_stats;
+StatLog *stat_log = &shell_stats; // a server session swaps in its own
+
+static double stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void stats_begin(CommandStat *st, pid_t pid, const char *name, const Placement *placement) {
+    memset(st, 0, sizeof(*st));
+    st->pid = pid;
+    snprintf(st->name, sizeof(st->name), "%s", name);
+    strcpy(st->cpus, "-");
+    strcpy(st->nodes, "-");
+    if (placement && placement->active) {
+        format_cpulist(&placement->cpus, st->cpus, sizeof(st->cpus));
+        size_t len = 0;
+        for (int n = 0; n < MAX_NODES && placement->nodes; n++) {
+            if ((placement->nodes >> n) & 1 && len < sizeof(st->nodes)) {
+                len += snprintf(st->nodes + len, sizeof(st->nodes) - len, "%s%d", len ? "," : "", n);
+            }
+        }
+    }
+    st->start = stats_now();
+}
+
+void stats_end(StatLog *log, CommandStat *st, int status, const struct rusage *usage) {
+    st->end = stats_now();
+    st->status = status;
+    st->usage = *usage;
+    log->entries[log->count++ % STATS_KEPT] = *st;
+}
+
+static double tv_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// One line per remembered command, oldest first
+int stats_format(StrBuf *out) {
+    StatLog *log = stat_log;
+    char line[256];
+    int first = log->count > STATS_KEPT ? log->count - STATS_KEPT : 0;
+
+    snprintf(line, sizeof(line), "%7s %6s %8s %8s %8s %9s %7s %6s %6s %12s %6s  %s\n", "PID", "STATUS",
+             "WALL", "USER", "SYS", "MAXRSS_KB", "MINFLT", "VCSW", "IVCSW", "CPUS", "NODES", "COMMAND");
+    if (sb_append(out, line, strlen(line)) < 0) return -1;
+    for (int i = first; i < log->count; i++) {
+        const CommandStat *st = &log->entries[i % STATS_KEPT];
+        char status[16];
+        if (WIFSIGNALED(st->status)) snprintf(status, sizeof(status), "sig%d", WTERMSIG(st->status));
+        else snprintf(status, sizeof(status), "%d", WEXITSTATUS(st->status));
+        snprintf(line, sizeof(line), "%7d %6s %8.3f %8.3f %8.3f %9ld %7ld %6ld %6ld %12s %6s  %s\n",
+                 (int) st->pid, status, st->end - st->start, tv_seconds(st->usage.ru_utime),
+                 tv_seconds(st->usage.ru_stime), st->usage.ru_maxrss, st->usage.ru_minflt,
+                 st->usage.ru_nvcsw, st->usage.ru_nivcsw, st->cpus, st->nodes, st->name);
+        if (sb_append(out, line, strlen(line)) < 0) return -1;
+    }
+    return 0;
+}
+
+int builtin_stats(ShellOut *out) {
+    StrBuf text = { NULL, 0, 0 };
+    int rc = stats_format(&text) < 0 || shell_out_write(out, text.data, text.len) < 0;
+    free(text.data);
+    return rc;
+}
+
+// Shares echo.h with myecho: -n, -e, and one writev() per line
+int builtin_echo(char **args, ShellOut *out) {
+    EchoLine line;
+    int rc = echo_build(&line, args) < 0;
+    if (!rc && out->buf) {
+        // Capturing for $(...): gather straight into the buffer
+        size_t len = echo_length(&line);
+        rc = sb_reserve(out->buf, len) < 0;
+        if (!rc) {
+            echo_flatten(&line, out->buf->data + out->buf->len);
+            out->buf->len += len;
+            out->buf->data[out->buf->len] = '\0';
+        }
+    } else if (!rc) {
+        rc = echo_write(out->fd, &line) < 0;
+    }
+    echo_free(&line);
+    return rc;
+}
+
+int builtin_pwd(ShellOut *out) {
+    char cwd[BUF_SIZE];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    size_t len = strlen(cwd);
+    cwd[len++] = '\n';
+    return shell_out_write(out, cwd, len) < 0;
+}
+
+// ---------------------------------------------------------------------------
+// Pipelines. External stages are started first, with fds 0-2 pointed at
+// their pipe ends just long enough to fork or hand them to the zygote.
+// Builtin stages then run on threads in the shell and write to an fd of
+// their own rather than STDOUT_FILENO, so `echo $BIG | wc -c` forks once and
+// a pipeline made only of builtins never forks.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    char **args;            // owned copy; the line is freed while we run
+    char *text;             // output worked out in advance (pwd), or NULL for echo
+    ShellOut out;           // fd owned by the stage, closed when it is done
+    int status;             // 0 or 1, like the builtin's return value
+    int started;
+    pthread_t thread;
+} BuiltinStage;
+
+// What a line left running, for the caller to wait on
+typedef struct {
+    pid_t *pids;            // external commands not yet waited for
+    int count;
+    pid_t status_pid;       // command whose exit status is the line's, or 0
+    int status;             // its wait status once reaped
+    BuiltinStage *stages;   // builtin threads, joined by job_finish()
+    int stage_count;
+    int status_stage;       // builtin whose status is the line's, or -1
+    CommandStat *stats;     // one per pid, in the same order
+    StatLog *log;           // where finished commands are recorded
+} Job;
+
+#define JOB_INIT { NULL, 0, 0, 0, NULL, 0, -1, NULL, NULL }
+
+static void job_add_pid(Job *job, pid_t pid, const char *name, const Placement *placement) {
+    pid_t *pids = (pid_t *) realloc(job->pids, (job->count + 1) * sizeof(pid_t));
+    if (pids) job->pids = pids;
+    CommandStat *stats = (CommandStat *) realloc(job->stats, (job->count + 1) * sizeof(CommandStat));
+    if (stats) job->stats = stats;
+    if (!pids || !stats) return; // can't track it; the zygote or init reaps it
+    job->log = stat_log;
+    job->pids[job->count] = pid;
+    stats_begin(&job->stats[job->count], pid, name, placement);
+    job->count++;
+}
+
+int job_running(const Job *job) {
+    return job->count > 0 || job->stage_count > 0;
+}
+
+// pids[i] exited with `status`: record it, keep the status if it is the
+// line's and drop the pid (the last one moves into slot i)
+void job_reap(Job *job, int i, int status, const struct rusage *usage) {
+    if (job->pids[i] == job->status_pid) job->status = status;
+    stats_end(job->log, &job->stats[i], status, usage);
+    job->count--;
+    job->pids[i] = job->pids[job->count];
+    job->stats[i] = job->stats[job->count];
+}
+
+// Join the builtin threads and fold the line's status into the caller's
+// flags. Call once every pid has been reaped.
+void job_finish(Job *job, int *last_status, int *has_error) {
+    for (int i = 0; i < job->stage_count; i++) {
+        BuiltinStage *st = &job->stages[i];
+        if (st->started) pthread_join(st->thread, NULL);
+        if (i == job->status_stage) job->status = st->status << 8;
+        for (int j = 0; st->args[j]; j++) free(st->args[j]);
+        free(st->args);
+        free(st->text);
+    }
+    if (job->status_pid > 0 || job->status_stage >= 0) {
+        record_exit_status(job->status, last_status, has_error);
+    }
+    free(job->pids);
+    free(job->stages);
+    free(job->stats);
+    *job = (Job) JOB_INIT;
+}
+
+// Wait for everything the job started
+void job_wait(Job *job, int *last_status, int *has_error) {
+    while (job->count > 0) {
+        int status;
+        struct rusage usage;
+        memset(&usage, 0, sizeof(usage));
+        if (wait_command(job->pids[0], &status, &usage) != job->pids[0]) status = 1 << 8;
+        job_reap(job, 0, status, &usage);
+    }
+    job_finish(job, last_status, has_error);
+}
+
+static int is_builtin(const char *name) {
+    return strcmp(name, "echo") == 0 || strcmp(name, "pwd") == 0 || strcmp(name, "cd") == 0 ||
+           strcmp(name, "export") == 0 || strcmp(name, "exit") == 0 || strcmp(name, "stats") == 0;
+}
+
+// `pin CPULIST cmd args...`: step *argv past the prefix and fill in the
+// placement. Returns 1 if pinned, 0 if argv does not start with pin, -1 on
+// a usage error (already reported).
+static int take_pin(char ***argv, Placement *placement) {
+    char **args = *argv;
+    if (strcmp(args[0], "pin") != 0) return 0;
+    if (args[1] == NULL || args[2] == NULL) {
+        fprintf(stderr, "pin: usage: pin CPULIST command [args...]\n");
+        return -1;
+    }
+    if (placement_pin(args[1], placement) < 0) {
+        fprintf(stderr, "pin: bad cpu list '%s'\n", args[1]);
+        return -1;
+    }
+    *argv = args + 2;
+    return 1;
+}
+
+static void *builtin_stage_run(void *arg) {
+    BuiltinStage *st = (BuiltinStage *) arg;
+
+    // A reader that went away gives this thread EPIPE instead of killing the shell
+    sigset_t pipe_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, NULL);
+
+    if (st->text) {
+        st->status |= shell_out_write(&st->out, st->text, strlen(st->text)) < 0;
+    } else {
+        st->status = builtin_echo(st->args, &st->out) != 0;
+    }
+    close(st->out.fd);
+    return NULL;
+}
+
+// Start argv with the shell's current fds 0-2, through the zygote if it runs
+static pid_t spawn_command(char **argv, const Placement *placement) {
+    if (zygote_fd >= 0) return zygote_spawn(argv, placement);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (int j = 0; j < var_count; j++) {
+            if (variables[j].exported) {
+                setenv(variables[j].name, variables[j].value, 1);
+            }
+        }
+        signal(SIGPIPE, SIG_DFL);
+        placement_apply(placement);
+        execvp(argv[0], argv);
+        fprintf(stderr, "%s: command not found\n", argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+// Open a stage's <, > and 2> files over its entries in fds[] (stdin, stdout,
+// stderr). opened[] marks the fds opened here, which the caller closes.
+static int stage_redirections(char **tokens, int token_count, int fds[3], int opened[3]) {
+    if (!setup_redirection(tokens, token_count, 1)) return 0;
+    for (int i = 0; i + 1 < token_count; i++) {
+        int target, flags;
+        if (tokens[i] == op_in) {
+            target = 0;
+            flags = O_RDONLY;
+        } else if (tokens[i] == op_out || tokens[i] == op_err) {
+            target = tokens[i][0] == '2' ? 2 : 1;
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+        } else {
+            continue;
+        }
+        int fd = open(tokens[++i], flags | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror(tokens[i]);
+            return 0;
+        }
+        if (opened[target]) close(fds[target]);
+        fds[target] = fd;
+        opened[target] = 1;
+    }
+    return 1;
+}
+
+// Run `a | b | ...`. With a job, the commands are left running in it for
+// the caller; otherwise they are waited for here.
+int run_pipeline(char **tokens, int token_count, int *last_status, int *has_error, Job *job) {
+    int nstages = 1;
+    for (int i = 0; i < token_count; i++) {
+        if (tokens[i] == op_pipe) nstages++;
+    }
+
+    // Token range of each stage: bounds[k] up to the '|' before bounds[k + 1]
+    int *bounds = (int *) malloc((nstages + 1) * sizeof(int));
+    int (*pipes)[2] = (int (*)[2]) malloc(nstages * sizeof(*pipes));
+    Job local = JOB_INIT;
+    if (!job) job = &local;
+    job->stages = (BuiltinStage *) calloc(nstages, sizeof(BuiltinStage));
+    if (!bounds || !pipes || !job->stages) {
+        fprintf(stderr, "Memory allocation error\n");
+        free(bounds);
+        free(pipes);
+        free(job->stages);
+        job->stages = NULL;
+        *last_status = 1;
+        *has_error = 1;
+        return 0;
+    }
+    bounds[0] = 0;
+    for (int i = 0, k = 1; i < token_count; i++) {
+        if (tokens[i] == op_pipe) bounds[k++] = i + 1;
+    }
+    bounds[nstages] = token_count + 1;
+
+    int npipes = 0, ok = 1;
+    for (int k = 0; k < nstages && ok; k++) {
+        int argc = 0;
+        char **args = extract_command_args(tokens + bounds[k], bounds[k + 1] - 1 - bounds[k], &argc);
+        if (argc == 0) {
+            fprintf(stderr, "syntax error near unexpected token `|'\n");
+            ok = 0;
+        }
+        for (int j = 0; j < argc; j++) free(args[j]);
+        free(args);
+    }
+    for (; ok && npipes < nstages - 1; npipes++) {
+        if (pipe2(pipes[npipes], O_CLOEXEC) < 0) {
+            perror("pipe");
+            ok = 0;
+            break;
+        }
+    }
+    if (!ok) {
+        for (int k = 0; k < npipes; k++) {
+            close(pipes[k][0]);
+            close(pipes[k][1]);
+        }
+        free(bounds);
+        free(pipes);
+        free(job->stages);
+        job->stages = NULL;
+        *last_status = 1;
+        *has_error = 1;
+        return 0;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    int saved[3];
+    for (int i = 0; i < 3; i++) saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+
+    for (int k = 0; k < nstages; k++) {
+        char **stage = tokens + bounds[k];
+        int count = bounds[k + 1] - 1 - bounds[k];
+        int last = k == nstages - 1;
+        int fds[3] = { k == 0 ? saved[0] : pipes[k - 1][0], last ? saved[1] : pipes[k][1], saved[2] };
+        int opened[3] = { 0, 0, 0 };
+        int argc = 0;
+        char **args = extract_command_args(stage, count, &argc);
+        char **argv = args;
+        Placement placement;
+        int pinned = take_pin(&argv, &placement);
+
+        if (pinned < 0 || !stage_redirections(stage, count, fds, opened)) {
+            if (last) {
+                *last_status = 1;
+                *has_error = 1;
+            }
+        } else if (!pinned && is_builtin(args[0])) {
+            // cd, export and exit only affect a subshell here, as in bash
+            BuiltinStage *st = &job->stages[job->stage_count];
+            st->args = args;
+            args = NULL;
+            if (strcmp(st->args[0], "pwd") == 0) {
+                char cwd[BUF_SIZE];
+                if (getcwd(cwd, sizeof(cwd) - 1) == NULL) {
+                    perror("pwd");
+                    st->status = 1;
+                    cwd[0] = '\0';
+                } else {
+                    strcat(cwd, "\n");
+                }
+                st->text = strdup(cwd);
+            } else if (strcmp(st->args[0], "stats") == 0) {
+                StrBuf text = { NULL, 0, 0 };
+                stats_format(&text);
+                st->text = text.data ? text.data : strdup("");
+            } else if (strcmp(st->args[0], "echo") != 0) {
+                st->text = strdup("");
+            }
+            st->out.fd = fcntl(fds[1], F_DUPFD_CLOEXEC, 3);
+            st->out.buf = NULL;
+            if (last) job->status_stage = job->stage_count;
+            job->stage_count++;
+        } else {
+            dup2(fds[0], STDIN_FILENO);
+            dup2(fds[1], STDOUT_FILENO);
+            dup2(fds[2], STDERR_FILENO);
+            // Round-robin placement counts each stage as a command of its own
+            if (!pinned) placement_next(&placement);
+            pid_t pid = spawn_command(argv, &placement);
+            if (pid < 0) {
+                perror("Fork failed");
+                if (last) {
+                    *last_status = 1;
+                    *has_error = 1;
+                }
+            } else {
+                job_add_pid(job, pid, argv[0], &placement);
+                if (last) job->status_pid = pid;
+            }
+        }
+
+        for (int i = 0; i < 3; i++) {
+            if (opened[i]) close(fds[i]);
+        }
+        if (args) {
+            for (int j = 0; j < argc; j++) free(args[j]);
+            free(args);
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+
+    // Every external stage is running, so builtins can block on full pipes
+    for (int i = 0; i < job->stage_count; i++) {
+        BuiltinStage *st = &job->stages[i];
+        if (st->out.fd < 0 || !(st->text || st->args)) {
+            st->status = 1;
+        } else if (pthread_create(&st->thread, NULL, builtin_stage_run, st) != 0) {
+            perror("pthread_create");
+            close(st->out.fd);
+            st->status = 1;
+        } else {
+            st->started = 1;
+        }
+    }
+
+    // Readers see EOF once the stages themselves are the only writers
+    for (int k = 0; k < npipes; k++) {
+        close(pipes[k][0]);
+        close(pipes[k][1]);
+    }
+    free(pipes);
+    free(bounds);
+
+    if (job == &local) job_wait(job, last_status, has_error);
+    return 0;
+}
+
+// Start an external command with the given placement. With a job it is
+// left running there; otherwise it is waited for here.
+static void launch_command(char **tokens, int token_count, char **cmd_args, const Placement *placement,
+                           int *last_status, int *has_error, Job *job) {
+    pid_t pid;
+    Job local = JOB_INIT;
+    if (!job) job = &local;
+
+    // Validate redirections first
+    if (!setup_redirection(tokens, token_count, 1)) {
+        *last_status = 1;
+        *has_error = 1;
+        return;
+    }
+    if (zygote_fd >= 0) {
+        // Redirect here and hand the resulting stdio to the zygote
+        if (!setup_redirection(tokens, token_count, 0)) {
+            *last_status = 1;
+            *has_error = 1;
+            return;
+        }
+        pid = zygote_spawn(cmd_args, placement);
+    } else {
+        // Fork and execute the command
+        pid = fork();
+        if (pid == 0) {
+            // Child process - set up redirections
+            if (!setup_redirection(tokens, token_count, 0)) {
+                exit(1); // Exit with error if redirection fails
+            }
+            
+            // Set environment variables
+            for (int j = 0; j < var_count; j++) {
+                if (variables[j].exported) {
+                    setenv(variables[j].name, variables[j].value, 1);
+                }
+            }
+            
+            // The server ignores SIGPIPE; commands must not inherit that
+            signal(SIGPIPE, SIG_DFL);
+            placement_apply(placement);
+
+            // Execute command
+            execvp(cmd_args[0], cmd_args);
+            
+            // If execvp returns, an error occurred
+            fprintf(stderr, "%s: command not found\n", cmd_args[0]);
+            exit(127);  // standard shell convention for "command not found"
+        }
+    }
+
+    if (pid < 0) {
+        // Fork failed
+        perror("Fork failed");
+        *last_status = 1;
+        *has_error = 1;
+        return;
+    }
+    job_add_pid(job, pid, cmd_args[0], placement);
+    job->status_pid = pid;
+    if (job == &local) job_wait(job, last_status, has_error);
+}
+
+// Run an expanded, tokenized command: builtins in the shell, anything else
+// in a child. Returns 1 for `exit`; job works as for execute_line().
+int run_tokens(char **tokens, int token_count, char **cmd_args, int *last_status, int *has_error,
+               Job *job) {
+    Placement placement;
+
+    for (int i = 0; i < token_count; i++) {
+        if (tokens[i] == op_pipe) {
+            return run_pipeline(tokens, token_count, last_status, has_error, job);
+        }
+    }
+
+    // `pin CPULIST cmd` always runs cmd as an external command
+    int pinned = take_pin(&cmd_args, &placement);
+    if (pinned < 0) {
+        *last_status = 1;
+        *has_error = 1;
+        return 0;
+    }
+
+    // Save original file descriptors
+    int original_stdin = dup(STDIN_FILENO);
+    int original_stdout = dup(STDOUT_FILENO);
+    int original_stderr = dup(STDERR_FILENO);
+    int exit_requested = 0;
+    
+    // Handle built-in commands
+    if (pinned) {
+        launch_command(tokens, token_count, cmd_args, &placement, last_status, has_error, job);
+    } else if (strcmp(cmd_args[0], "pwd") == 0) {
+        // Validate redirections first, but don't perform them yet
+        if (!setup_redirection(tokens, token_count, 1)) {
+            *last_status = 1;
+            *has_error = 1;
+        } else {
+            // Now actually perform redirections
+            if (setup_redirection(tokens, token_count, 0)) {
+                ShellOut out = shell_stdout();
+                if (builtin_pwd(&out) == 0) {
+                    *last_status = 0;
+                } else {
+                    *last_status = 1;
+                    *has_error = 1;
+                }
+            } else {
+                // This should never happen since we already validated
+                *last_status = 1;
+                *has_error = 1;
+            }
+        }
+    } else if (strcmp(cmd_args[0], "echo") == 0) {
+        // Validate redirections first, but don't perform them yet
+        if (!setup_redirection(tokens, token_count, 1)) {
+            *last_status = 1;
+            *has_error = 1;
+        } else {
+            // Now actually perform redirections
+            if (setup_redirection(tokens, token_count, 0)) {
+                // Output the echo arguments
+                ShellOut out = shell_stdout();
+                builtin_echo(cmd_args, &out);
+                *last_status = 0;
+            } else {
+                // This should never happen since we already validated
+                *last_status = 1;
+                *has_error = 1;
+            }
+        }
+    } else if (strcmp(cmd_args[0], "cd") == 0) {
+        if (cmd_args[1] == NULL) {
+            fprintf(stderr, "cd: missing argument\n");
+            *last_status = 1;
+            *has_error = 1;
+        } else if (chdir(cmd_args[1]) != 0) {
+            fprintf(stderr, "cd: %s: No such file or directory\n", cmd_args[1]);
+            *last_status = 1;
+            *has_error = 1;
+        } else {
+            *last_status = 0;
+        }
+    } else if (strcmp(cmd_args[0], "export") == 0) {
+        if (cmd_args[1] == NULL) {
+            fprintf(stderr, "export: missing argument\n");
+            *last_status = 1;
+            *has_error = 1;
+        } else {
+            export_variable(cmd_args[1]);
+            *last_status = 0;
+        }
+    } else if (strcmp(cmd_args[0], "exit") == 0) {
+        printf("Good Bye\n");
+        fflush(stdout);
+        exit_requested = 1;
+    } else if (strcmp(cmd_args[0], "stats") == 0) {
+        if (!setup_redirection(tokens, token_count, 1) || !setup_redirection(tokens, token_count, 0)) {
+            *last_status = 1;
+            *has_error = 1;
+        } else {
+            ShellOut out = shell_stdout();
+            *last_status = builtin_stats(&out);
+        }
+    } else {
+        placement_next(&placement);
+        launch_command(tokens, token_count, cmd_args, &placement, last_status, has_error, job);
+    }
+    
+    // Restore original file descriptors
+    dup2(original_stdin, STDIN_FILENO);
+    dup2(original_stdout, STDOUT_FILENO);
+    dup2(original_stderr, STDERR_FILENO);
+    close(original_stdin);
+    close(original_stdout);
+    close(original_stderr);
+    return exit_requested;
+}
+
+// Does this line assign a variable (name=value, no spaces outside $(...))?
+static int is_assignment(const char *buf) {
+    const char *eq = strchr(buf, '=');
+    if (eq == NULL || eq == buf) return 0;
+    for (const char *p = buf; p < eq; p++) {
+        if (*p == ' ') return 0;
+    }
+    for (const char *p = eq + 1; *p; p++) {
+        if (*p == ' ') return 0;
+        const char *end = NULL;
+        if (*p == '`') end = strchr(p + 1, '`');
+        else if (*p == '$' && p[1] == '(') end = find_subst_end(p + 2);
+        if (end) p = end;
+    }
+    return 1;
+}
+
+// Server mode: a substitution that runs a command must not hold up the
+// event loop. The command is started with its output going to a pipe and
+// the line is abandoned; the session collects the output and then runs the
+// line again from the top. Substitutions are numbered in the order they are
+// reached, which is the same on every run, so a rerun takes the finished
+// ones from `results`. Expansion has no side effects, so rerunning is safe.
+typedef struct {
+    Job *job;               // where the command is left running
+    StrBuf *results;        // by number; data is NULL until finished
+    int count;
+    int next;               // number of the next substitution reached
+    int pending_fd;         // read end of the started command's output, or -1
+    int pending_index;
+} CaptureReplay;
+
+CaptureReplay *capture_replay = NULL;  // set while a server line runs
+
+#define CAPTURE_PENDING -2
+
+// The line stopped at a substitution that is still running
+int capture_suspended(void) {
+    return capture_replay && capture_replay->pending_fd >= 0;
+}
+
+// Run `cmd` for $(...) or `...` and append its standard output to `out`,
+// minus trailing newlines. echo and pwd write straight into the buffer
+// without forking; cd, export, exit and assignments act on a subshell in
+// other shells, so here they do nothing. Anything else writes into a pipe
+// that is read directly into `out`, or, in server mode, is left running
+// (see CaptureReplay) and CAPTURE_PENDING is returned.
+int capture_command(const char *cmd, StrBuf *out) {
+    size_t start = out->len;
+    int last_status = 0, has_error = 0;
+
+    int index = -1;
+    if (capture_replay) {
+        index = capture_replay->next++;
+        if (index < capture_replay->count && capture_replay->results[index].data) {
+            StrBuf *done = &capture_replay->results[index];
+            return sb_append(out, done->data, done->len);
+        }
+        if (index >= capture_replay->count) {
+            StrBuf *results = (StrBuf *) realloc(capture_replay->results, (index + 1) * sizeof(StrBuf));
+            if (!results) return -1;
+            memset(results + capture_replay->count, 0, (index + 1 - capture_replay->count) * sizeof(StrBuf));
+            capture_replay->results = results;
+            capture_replay->count = index + 1;
+        }
+    }
+
+    if (is_assignment(cmd)) return 0;
+
+    unsigned char *literal = NULL;
+    char *expanded = expand_variables(cmd, &literal);
+    if (!expanded) return capture_suspended() ? CAPTURE_PENDING : -1;
+
+    int token_count = 0;
+    unsigned char *quoted = NULL;
+    char **tokens = tokenize_command(expanded, literal, &token_count, &quoted);
+    free(literal);
+    if (!tokens || token_count == 0) {
+        free(tokens);
+        free(quoted);
+        free(expanded);
+        return 0;
+    }
+    expand_globs(&tokens, &token_count, quoted);
+    free(quoted);
+
+    int cmd_count = 0;
+    char **cmd_args = extract_command_args(tokens, token_count, &cmd_count);
+    int stdout_redirected = 0, piped = 0;
+    for (int i = 0; i < token_count; i++) {
+        if (tokens[i] == op_out) stdout_redirected = 1;
+        if (tokens[i] == op_pipe) piped = 1;
+    }
+
+    int rc = 0;
+    ShellOut sink = { -1, out };
+    if (!cmd_args || cmd_count == 0) {
+        // Only redirections: nothing to capture
+    } else if (!piped && !stdout_redirected && strcmp(cmd_args[0], "echo") == 0) {
+        builtin_echo(cmd_args, &sink);
+    } else if (!piped && !stdout_redirected && strcmp(cmd_args[0], "pwd") == 0) {
+        builtin_pwd(&sink);
+    } else if (!piped && (strcmp(cmd_args[0], "cd") == 0 || strcmp(cmd_args[0], "export") == 0 ||
+                          strcmp(cmd_args[0], "exit") == 0)) {
+        // No effect outside the substitution
+    } else {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            rc = -1;
+        } else if (capture_replay) {
+            fflush(stdout);
+            int saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+            dup2(fds[1], STDOUT_FILENO);
+            run_tokens(tokens, token_count, cmd_args, &last_status, &has_error, capture_replay->job);
+            dup2(saved_stdout, STDOUT_FILENO);
+            close(saved_stdout);
+            close(fds[1]);
+            capture_replay->pending_fd = fds[0];
+            capture_replay->pending_index = index;
+            rc = CAPTURE_PENDING;
+        } else {
+            Job job = JOB_INIT;
+            fflush(stdout);
+            int saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+            dup2(fds[1], STDOUT_FILENO);
+            run_tokens(tokens, token_count, cmd_args, &last_status, &has_error, &job);
+            dup2(saved_stdout, STDOUT_FILENO);
+            close(saved_stdout);
+            close(fds[1]);
+
+            while (1) {
+                if (sb_reserve(out, 65536) < 0) {
+                    rc = -1;
+                    break;
                 }
+                ssize_t n = read(fds[0], out->data + out->len, out->cap - out->len - 1);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                out->len += n;
             }
-        } else if (strcmp(cmd_args[0], "cd") == 0) {
-            if (cmd_args[1] == NULL) {
-                fprintf(stderr, "cd: missing argument\n");
-                last_status = 1;
-                has_error = 1;
-            } else if (chdir(cmd_args[1]) != 0) {
-                fprintf(stderr, "cd: %s: No such file or directory\n", cmd_args[1]);
-                last_status = 1;
-                has_error = 1;
-            } else {
-                last_status = 0;
+            close(fds[0]);
+            job_wait(&job, &last_status, &has_error);
+        }
+    }
+
+    if (rc != CAPTURE_PENDING) {
+        while (out->len > start && out->data[out->len - 1] == '\n') out->len--;
+        if (out->data) out->data[out->len] = '\0';
+    }
+
+    if (cmd_args) {
+        for (int j = 0; j < cmd_count; j++) free(cmd_args[j]);
+        free(cmd_args);
+    }
+    for (int j = 0; j < token_count; j++) free_token(tokens[j]);
+    free(tokens);
+    free(expanded);
+    return rc;
+}
+
+// Function to run one command line. Returns 1 when the line was `exit`.
+// If job is not NULL, external commands and builtin pipeline stages are left
+// running in it for the caller to wait on; otherwise they are waited here.
+int execute_line(char *buf, int *last_status, int *has_error, Job *job) {
+
+    // Check for assignment (name=value, where value may use $(...))
+    if (is_assignment(buf)) {
+        char *eq = strchr(buf, '=');
+        *eq = '\0';
+        char *name = buf;
+        char *value = expand_variables(eq + 1, NULL);
+        if (!value && capture_suspended()) return 0;
+        if (!value) {
+            fprintf(stderr, "Memory allocation error\n");
+            *last_status = 1;
+            *has_error = 1;
+            return 0;
+        }
+        set_variable(name, value, 0);
+        free(value);
+        *last_status = 0;
+        return 0;
+    }
+
+    // Expand variables in the entire command line first
+    unsigned char *literal = NULL;
+    char *expanded_buf = expand_variables(buf, &literal);
+    if (!expanded_buf && capture_suspended()) return 0;
+    if (!expanded_buf) {
+        fprintf(stderr, "Memory allocation error\n");
+        *last_status = 1;
+        *has_error = 1;
+        return 0;
+    }
+    
+    // Tokenize the command
+    int token_count = 0;
+    unsigned char *quoted = NULL;
+    char **tokens = tokenize_command(expanded_buf, literal, &token_count, &quoted);
+    free(literal);
+    if (!tokens || token_count == 0) {
+        free(expanded_buf);
+        free(quoted);
+        if (tokens) free(tokens);
+        return 0;
+    }
+
+    // Pathname expansion of unquoted *, ? and [...] words
+    expand_globs(&tokens, &token_count, quoted);
+    free(quoted);
+    
+    // Extract command arguments (excluding redirection tokens)
+    int cmd_count = 0;
+    char **cmd_args = extract_command_args(tokens, token_count, &cmd_count);
+    if (!cmd_args || cmd_count == 0) {
+        for (int i = 0; i < token_count; i++) {
+            free_token(tokens[i]);
+        }
+        free(tokens);
+        free(expanded_buf);
+        return 0;
+    }
+    
+    int exit_requested = run_tokens(tokens, token_count, cmd_args, last_status, has_error, job);
+
+    // Free argument arrays
+    for (int j = 0; j < cmd_count; j++) {
+        if (cmd_args[j]) free(cmd_args[j]);
+    }
+    free(cmd_args);
+    
+    for (int j = 0; j < token_count; j++) {
+        free_token(tokens[j]);
+    }
+    free(tokens);
+    
+    free(expanded_buf);
+    return exit_requested;
+}
+
+// ---------------------------------------------------------------------------
+// Server mode: many sessions over a Unix domain socket, multiplexed by epoll.
+// Each session owns its variables, working directory and fd plan; they are
+// swapped into the shell's globals while one of its lines runs. A line's
+// output goes into a pipe the loop drains into the session's output queue,
+// which is written to the non-blocking client socket as it accepts it. A
+// session whose queue is full is not read from until the client catches up,
+// so a client that stops reading only ever stalls itself. A line waiting for
+// a $(...) command is suspended the same way (see CaptureReplay).
+// ---------------------------------------------------------------------------
+
+#define MAX_EVENTS 64
+#define OUTPUT_MAX (1 << 20)    // queued bytes at which a session stops producing
+
+enum { SRC_LISTEN, SRC_CONN, SRC_CHILD, SRC_OUTPUT, SRC_CAPTURE, SRC_ZYGOTE };
+
+typedef struct Session Session;
+
+typedef struct {
+    int kind;
+    Session *session;
+} EventSource;
+
+struct Session {
+    int fd;                 // client connection, non-blocking
+    int cwd_fd;             // session working directory
+    ShellVar *variables;
+    int var_count;
+    int last_status;
+    int has_error;
+    char inbuf[BUF_SIZE];   // bytes received but not yet run
+    size_t inlen;
+    int eof;
+    StrBuf out;             // output not yet written to the client
+    size_t out_sent;        // bytes at the front of `out` already written
+    int out_fd;             // read end of the running line's output pipe
+    int out_watched;        // out_fd is in the epoll set
+    int conn_events;        // events asked for on fd, -1 once removed
+    int line_active;        // a line is running: its job or its output pipe
+    char *pending_line;     // line to run again once its substitution is done
+    CaptureReplay replay;   // substitutions of pending_line finished so far
+    int cap_fd;             // output of the running substitution, or -1
+    int broken;             // the client stopped taking output
+    int closing;            // close once the last line and its output are done
+    Job job;                // commands the current line left running
+    StatLog stats;          // for the `stats` builtin
+    int *child_fds;         // pidfd of each job pid when not using the zygote
+    int closed;
+    EventSource conn_src;
+    EventSource child_src;
+    EventSource out_src;
+    EventSource cap_src;
+    Session *next;          // all open sessions
+    Session *next_dead;
+};
+
+typedef struct {
+    int epfd;
+    int devnull;
+    int shell_stdin;
+    int shell_stdout;
+    int shell_stderr;
+    int shell_cwd;          // where new sessions start
+    Session *sessions;
+    Session *dead;          // closed sessions, freed after each epoll batch
+} Server;
+
+static size_t session_backlog(Session *s) {
+    return s->out.len - s->out_sent;
+}
+
+static void session_send(Session *s, const char *data, size_t len) {
+    if (!s->broken) sb_append(&s->out, data, len);
+}
+
+// Write as much queued output as the socket takes without blocking
+static void session_flush(Session *s) {
+    while (!s->broken && s->out_sent < s->out.len) {
+        ssize_t n = write(s->fd, s->out.data + s->out_sent, s->out.len - s->out_sent);
+        if (n > 0) {
+            s->out_sent += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            // Client went away: lines it already sent still run, unheard
+            s->broken = 1;
+            s->eof = 1;
+        }
+    }
+    if (s->broken || s->out_sent == s->out.len) {
+        s->out.len = 0;
+        s->out_sent = 0;
+    } else if (s->out_sent >= 65536 && s->out_sent >= s->out.len / 2) {
+        memmove(s->out.data, s->out.data + s->out_sent, s->out.len - s->out_sent);
+        s->out.len -= s->out_sent;
+        s->out_sent = 0;
+    }
+}
+
+// Move the running line's output from its pipe into the queue, up to the
+// queue limit. Closes the pipe once every writer is gone.
+static void session_collect(Server *srv, Session *s) {
+    while (s->out_fd >= 0 && session_backlog(s) < OUTPUT_MAX) {
+        if (sb_reserve(&s->out, 65536) < 0) break;
+        ssize_t n = read(s->out_fd, s->out.data + s->out.len, s->out.cap - s->out.len - 1);
+        if (n > 0) {
+            if (!s->broken) s->out.len += n;
+            s->out.data[s->out.len] = '\0';
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (s->out_watched) {
+            epoll_ctl(srv->epfd, EPOLL_CTL_DEL, s->out_fd, NULL);
+            s->out_watched = 0;
+        }
+        close(s->out_fd);
+        s->out_fd = -1;
+    }
+}
+
+// Read the running substitution's output; at EOF it becomes the result the
+// line's next run uses
+static void session_capture(Server *srv, Session *s) {
+    while (s->cap_fd >= 0) {
+        StrBuf *result = &s->replay.results[s->replay.pending_index];
+        if (sb_reserve(result, 65536) < 0) break;
+        ssize_t n = read(s->cap_fd, result->data + result->len, result->cap - result->len - 1);
+        if (n > 0) {
+            result->len += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        while (result->len > 0 && result->data[result->len - 1] == '\n') result->len--;
+        result->data[result->len] = '\0';
+        epoll_ctl(srv->epfd, EPOLL_CTL_DEL, s->cap_fd, NULL);
+        close(s->cap_fd);
+        s->cap_fd = -1;
+    }
+}
+
+static void session_forget_line(Session *s) {
+    for (int i = 0; i < s->replay.count; i++) free(s->replay.results[i].data);
+    free(s->replay.results);
+    s->replay.results = NULL;
+    s->replay.count = 0;
+    free(s->pending_line);
+    s->pending_line = NULL;
+}
+
+static void session_close(Server *srv, Session *s) {
+    if (s->conn_events >= 0) {
+        epoll_ctl(srv->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    }
+    if (s->out_fd >= 0) {
+        epoll_ctl(srv->epfd, EPOLL_CTL_DEL, s->out_fd, NULL);
+        close(s->out_fd);
+    }
+    if (s->cap_fd >= 0) {
+        epoll_ctl(srv->epfd, EPOLL_CTL_DEL, s->cap_fd, NULL);
+        close(s->cap_fd);
+    }
+    session_forget_line(s);
+    close(s->fd);
+    close(s->cwd_fd);
+    free(s->out.data);
+    variables = s->variables;
+    var_count = s->var_count;
+    free_variables();
+    s->variables = NULL;
+    s->var_count = 0;
+    for (Session **pp = &srv->sessions; *pp; pp = &(*pp)->next) {
+        if (*pp == s) {
+            *pp = s->next;
+            break;
+        }
+    }
+    // Later events in the same batch may still point at this session
+    s->closed = 1;
+    s->next_dead = srv->dead;
+    srv->dead = s;
+}
+
+// Flush what the socket takes, then bring the epoll interest in line with
+// the session's state: read input and output only while the queue has room,
+// ask for EPOLLOUT only while something is queued.
+static void session_update(Server *srv, Session *s) {
+    session_flush(s);
+    size_t backlog = session_backlog(s);
+
+    int watch_out = s->out_fd >= 0 && backlog < OUTPUT_MAX;
+    if (watch_out != s->out_watched) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &s->out_src };
+        if (epoll_ctl(srv->epfd, watch_out ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, s->out_fd, &ev) == 0) {
+            s->out_watched = watch_out;
+        }
+    }
+
+    if (s->broken) {
+        // Hangups are reported even with no events asked for
+        if (s->conn_events >= 0) {
+            epoll_ctl(srv->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+            s->conn_events = -1;
+        }
+    } else {
+        int events = 0;
+        if (!s->eof && !s->closing && backlog < OUTPUT_MAX && s->inlen < sizeof(s->inbuf)) {
+            events |= EPOLLIN;
+        }
+        if (backlog > 0) events |= EPOLLOUT;
+        if (events != s->conn_events) {
+            struct epoll_event ev = { .events = events, .data.ptr = &s->conn_src };
+            epoll_ctl(srv->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+            s->conn_events = events;
+        }
+    }
+
+    if (s->closing && !s->line_active && session_backlog(s) == 0) {
+        session_close(srv, s);
+    }
+}
+
+// Swap the session's state into the shell and point stdio at `out`
+static void session_enter(Server *srv, Session *s, int out) {
+    variables = s->variables;
+    var_count = s->var_count;
+    stat_log = &s->stats;
+    if (fchdir(s->cwd_fd) != 0) {
+        perror("fchdir");
+    }
+    dup2(srv->devnull, STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    dup2(out, STDERR_FILENO);
+}
+
+static void session_leave(Server *srv, Session *s) {
+    fflush(stdout);
+    fflush(stderr);
+    dup2(srv->shell_stdin, STDIN_FILENO);
+    dup2(srv->shell_stdout, STDOUT_FILENO);
+    dup2(srv->shell_stderr, STDERR_FILENO);
+    s->variables = variables;
+    s->var_count = var_count;
+    variables = NULL;
+    var_count = 0;
+    stat_log = &shell_stats;
+
+    // Pick up a `cd` done by the line
+    int cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwd_fd >= 0) {
+        close(s->cwd_fd);
+        s->cwd_fd = cwd_fd;
+    }
+    if (fchdir(srv->shell_cwd) != 0) {
+        perror("fchdir");
+    }
+}
+
+// The line is over once every pid is reaped and its output pipe hit EOF.
+// A suspended line also waits for its substitution's output, and is then
+// run again by session_pump() instead of printing the prompt.
+static void session_line_check(Session *s) {
+    if (!s->line_active || s->job.count > 0 || s->out_fd >= 0 || s->cap_fd >= 0) return;
+    job_finish(&s->job, &s->last_status, &s->has_error);
+    free(s->child_fds);
+    s->child_fds = NULL;
+    s->line_active = 0;
+    if (!s->closing && !s->pending_line) session_send(s, PROMPT, strlen(PROMPT));
+}
+
+// Reap pids[i] of the session's job, dropping its pidfd if it has one
+static void session_reap(Server *srv, Session *s, int i, int status, const struct rusage *usage) {
+    if (s->child_fds) {
+        epoll_ctl(srv->epfd, EPOLL_CTL_DEL, s->child_fds[i], NULL);
+        close(s->child_fds[i]);
+        s->child_fds[i] = s->child_fds[s->job.count - 1];
+    }
+    job_reap(&s->job, i, status, usage);
+}
+
+// Watch each pid of the job with a pidfd. Returns 0 if that is not possible.
+static int session_watch(Server *srv, Session *s) {
+    s->child_fds = (int *) malloc(s->job.count * sizeof(int));
+    if (!s->child_fds) return 0;
+    for (int i = 0; i < s->job.count; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &s->child_src };
+        s->child_fds[i] = syscall(SYS_pidfd_open, s->job.pids[i], 0);
+        if (s->child_fds[i] < 0 || epoll_ctl(srv->epfd, EPOLL_CTL_ADD, s->child_fds[i], &ev) < 0) {
+            if (s->child_fds[i] >= 0) close(s->child_fds[i]);
+            for (int j = 0; j < i; j++) {
+                epoll_ctl(srv->epfd, EPOLL_CTL_DEL, s->child_fds[j], NULL);
+                close(s->child_fds[j]);
             }
-        } else if (strcmp(cmd_args[0], "export") == 0) {
-            if (cmd_args[1] == NULL) {
-                fprintf(stderr, "export: missing argument\n");
-                last_status = 1;
-                has_error = 1;
+            free(s->child_fds);
+            s->child_fds = NULL;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// No pidfd support: wait in place, still draining the output pipe so the
+// commands cannot fill it and stall
+static void session_wait_here(Server *srv, Session *s) {
+    while (s->job.count > 0) {
+        session_collect(srv, s);
+        session_capture(srv, s);
+        for (int i = 0; i < s->job.count;) {
+            int status;
+            struct rusage usage;
+            if (wait4(s->job.pids[i], &status, WNOHANG, &usage) == s->job.pids[i]) {
+                job_reap(&s->job, i, status, &usage);
             } else {
-                export_variable(cmd_args[1]);
-                last_status = 0;
+                i++;
             }
-        } else if (strcmp(cmd_args[0], "exit") == 0) {
-            printf("Good Bye\n");
-            for (int j = 0; j < cmd_count; j++) {
-                if (cmd_args[j]) free(cmd_args[j]);
+        }
+        if (s->job.count > 0) {
+            struct pollfd pfd[2] = { { s->out_fd, POLLIN, 0 }, { s->cap_fd, POLLIN, 0 } };
+            poll(pfd, 2, 10);
+        }
+    }
+}
+
+static void session_run_line(Server *srv, Session *s, const char *buf) {
+    char line[BUF_SIZE];
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0 || fcntl(pipefd[0], F_SETFL, O_NONBLOCK) < 0) {
+        const char *msg = strerror(errno);
+        session_forget_line(s);
+        session_send(s, "pipe: ", 6);
+        session_send(s, msg, strlen(msg));
+        session_send(s, "\n" PROMPT, strlen(PROMPT) + 1);
+        return;
+    }
+    fstat(pipefd[1], &output_pipe_st);
+    output_queue = &s->out;
+    output_pipe = pipefd[0];
+
+    // execute_line() writes into the line, and a rerun needs it intact
+    snprintf(line, sizeof(line), "%s", buf);
+    s->replay.job = &s->job;
+    s->replay.next = 0;
+    s->replay.pending_fd = -1;
+    capture_replay = &s->replay;
+
+    session_enter(srv, s, pipefd[1]);
+    int exit_requested = execute_line(line, &s->last_status, &s->has_error, &s->job);
+    session_leave(srv, s);
+    capture_replay = NULL;
+
+    close(pipefd[1]);
+    output_drain();
+    output_queue = NULL;
+    output_pipe = -1;
+    s->out_fd = pipefd[0];
+    s->line_active = 1;
+    if (exit_requested) s->closing = 1;
+
+    if (s->replay.pending_fd >= 0) {
+        // Suspended at a substitution: read its output as it comes
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &s->cap_src };
+        s->cap_fd = s->replay.pending_fd;
+        s->replay.pending_fd = -1;
+        fcntl(s->cap_fd, F_SETFL, O_NONBLOCK);
+        epoll_ctl(srv->epfd, EPOLL_CTL_ADD, s->cap_fd, &ev);
+        if (!s->pending_line) s->pending_line = strdup(buf);
+    } else if (s->pending_line || s->replay.count > 0) {
+        session_forget_line(s);
+    }
+
+    // The zygote reports exits itself; see server_zygote_readable()
+    if (s->job.count > 0 && zygote_fd < 0 && !session_watch(srv, s)) {
+        session_wait_here(srv, s);
+    }
+    session_collect(srv, s);
+    session_line_check(s);
+}
+
+// Run buffered lines until one is still running, the output queue is full
+// or input runs out, then update what the session waits for
+static void session_pump(Server *srv, Session *s) {
+    session_line_check(s);
+    while (!s->line_active && !s->closing && session_backlog(s) < OUTPUT_MAX) {
+        if (s->pending_line) {
+            session_run_line(srv, s, s->pending_line);
+            continue;
+        }
+        char *nl = memchr(s->inbuf, '\n', s->inlen);
+        size_t line_len, consumed;
+        if (nl) {
+            line_len = nl - s->inbuf;
+            consumed = line_len + 1;
+        } else if (s->inlen == sizeof(s->inbuf)) {
+            line_len = s->inlen - 1; // overlong line: run what fits
+            consumed = line_len;
+        } else {
+            break;
+        }
+
+        char buf[BUF_SIZE];
+        memcpy(buf, s->inbuf, line_len);
+        buf[line_len] = '\0';
+        buf[strcspn(buf, "\r")] = 0;
+        s->inlen -= consumed;
+        memmove(s->inbuf, s->inbuf + consumed, s->inlen);
+
+        if (strlen(buf) == 0) {
+            session_send(s, PROMPT, strlen(PROMPT));
+            continue;
+        }
+        session_run_line(srv, s, buf);
+    }
+
+    if (s->eof && !s->line_active && !s->pending_line && !memchr(s->inbuf, '\n', s->inlen)) {
+        s->closing = 1;
+    }
+    session_update(srv, s);
+}
+
+static void session_open(Server *srv, int fd) {
+    Session *s = (Session *) calloc(1, sizeof(Session));
+    if (!s) {
+        close(fd);
+        return;
+    }
+    s->fd = fd;
+    s->out_fd = -1;
+    s->cap_fd = -1;
+    s->conn_events = EPOLLIN;
+    s->job = (Job) JOB_INIT;
+    s->cwd_fd = fcntl(srv->shell_cwd, F_DUPFD_CLOEXEC, 3);
+    s->conn_src.kind = SRC_CONN;
+    s->conn_src.session = s;
+    s->child_src.kind = SRC_CHILD;
+    s->child_src.session = s;
+    s->out_src.kind = SRC_OUTPUT;
+    s->out_src.session = s;
+    s->cap_src.kind = SRC_CAPTURE;
+    s->cap_src.session = s;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &s->conn_src };
+    if (s->cwd_fd < 0 || epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("session");
+        if (s->cwd_fd >= 0) close(s->cwd_fd);
+        close(fd);
+        free(s);
+        return;
+    }
+    s->next = srv->sessions;
+    srv->sessions = s;
+    session_send(s, PROMPT, strlen(PROMPT));
+    session_update(srv, s);
+}
+
+// Hand a zygote exit report to the session waiting for that command
+static void server_child_exited(Server *srv, ZygoteReply *reply) {
+    for (Session *s = srv->sessions; s; s = s->next) {
+        for (int i = 0; i < s->job.count; i++) {
+            if (s->job.pids[i] == reply->pid) {
+                session_reap(srv, s, i, reply->status, &reply->usage);
+                session_pump(srv, s);
+                return;
             }
-            free(cmd_args);
-            
-            for (int j = 0; j < token_count; j++) {
-                if (tokens[j]) free(tokens[j]);
+        }
+    }
+}
+
+// Readiness may be stale: zygote_spawn() can have read the pending replies
+// into the stash since epoll reported it, and a blocking read would then
+// stall every session. Only read while poll() says a reply is there.
+static void server_zygote_readable(Server *srv) {
+    struct pollfd pfd = { zygote_fd, POLLIN, 0 };
+    while (zygote_fd >= 0 && poll(&pfd, 1, 0) > 0) {
+        ZygoteReply reply;
+        if (zygote_read_reply(&reply) < 0) {
+            // Commands it was running can no longer be waited for
+            for (Session *s = srv->sessions, *next; s; s = next) {
+                next = s->next;
+                if (s->job.count > 0) {
+                    struct rusage none;
+                    memset(&none, 0, sizeof(none));
+                    while (s->job.count > 0) session_reap(srv, s, 0, 1 << 8, &none);
+                    session_pump(srv, s);
+                }
             }
-            free(tokens);
-            
-            free(expanded_buf);
-            free_variables();
-            close(original_stdin);
-            close(original_stdout);
-            close(original_stderr);
-            return has_error ? 1 : last_status;
-        } else {
-            // Validate redirections first
-            if (!setup_redirection(tokens, token_count, 1)) {
-                last_status = 1;
-                has_error = 1;
+            return;
+        }
+        if (reply.type == ZYGOTE_EXITED) {
+            server_child_exited(srv, &reply);
+        }
+    }
+}
+
+static void session_event(Server *srv, Session *s, uint32_t events) {
+    int hangup = (events & (EPOLLHUP | EPOLLERR)) != 0;
+    if (events & EPOLLOUT || hangup) {
+        session_flush(s);
+    }
+    if (events & EPOLLIN || hangup) {
+        // After a hangup there are no more events: read everything now
+        while (!s->eof && s->inlen < sizeof(s->inbuf)) {
+            ssize_t n = read(s->fd, s->inbuf + s->inlen, sizeof(s->inbuf) - s->inlen);
+            if (n > 0) {
+                s->inlen += n;
+                if (!hangup) break;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
             } else {
-                // Fork and execute the command
-                pid = fork();
-                if (pid == 0) {
-                    // Child process - set up redirections
-                    if (!setup_redirection(tokens, token_count, 0)) {
-                        exit(1); // Exit with error if redirection fails
-                    }
-                    
-                    // Set environment variables
-                    for (int j = 0; j < var_count; j++) {
-                        if (variables[j].exported) {
-                            setenv(variables[j].name, variables[j].value, 1);
-                        }
-                    }
-                    
-                    // Execute command
-                    execvp(cmd_args[0], cmd_args);
-                    
-                    // If execvp returns, an error occurred
-                    fprintf(stderr, "%s: command not found\n", cmd_args[0]);
-                    exit(127);  // standard shell convention for "command not found"
-                } else if (pid > 0) {
-                    // Parent process
+                s->eof = 1;
+                // A final line without a newline still runs
+                if (s->inlen > 0 && s->inbuf[s->inlen - 1] != '\n' && s->inlen < sizeof(s->inbuf)) {
+                    s->inbuf[s->inlen++] = '\n';
+                }
+            }
+        }
+    }
+    if (hangup) {
+        s->broken = 1;
+        s->eof = 1;
+    }
+    session_pump(srv, s);
+}
+
+int microshell_server(const char *socket_path) {
+    Server srv;
+    EventSource listen_src = { SRC_LISTEN, NULL };
+    EventSource zygote_src = { SRC_ZYGOTE, NULL };
+    struct sockaddr_un addr;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", socket_path);
+        return 1;
+    }
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lfd < 0) {
+        perror("socket");
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(lfd, SOMAXCONN) < 0) {
+        perror(socket_path);
+        close(lfd);
+        return 1;
+    }
+
+    srv.epfd = epoll_create1(EPOLL_CLOEXEC);
+    srv.devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+    srv.shell_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+    srv.shell_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    srv.shell_stderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+    srv.shell_cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    srv.sessions = NULL;
+    srv.dead = NULL;
+    if (srv.epfd < 0 || srv.devnull < 0 || srv.shell_cwd < 0) {
+        perror("server");
+        close(lfd);
+        return 1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_src };
+    epoll_ctl(srv.epfd, EPOLL_CTL_ADD, lfd, &ev);
+    if (zygote_fd >= 0) {
+        struct epoll_event zev = { .events = EPOLLIN, .data.ptr = &zygote_src };
+        epoll_ctl(srv.epfd, EPOLL_CTL_ADD, zygote_fd, &zev);
+    }
+
+    // A client hanging up mid-write must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+    server_mode = 1;
+    fprintf(stderr, "MicroShell listening on %s\n", socket_path);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        // Exits the zygote reported while we were waiting for a spawn
+        ZygoteReply reply;
+        while (zygote_take_stashed(-1, &reply)) {
+            server_child_exited(&srv, &reply);
+        }
+        while (srv.dead) {
+            Session *s = srv.dead;
+            srv.dead = s->next_dead;
+            free(s);
+        }
+
+        int n = epoll_wait(srv.epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            EventSource *src = (EventSource *) events[i].data.ptr;
+            if (src->session && src->session->closed) {
+                continue;
+            }
+            if (src->kind == SRC_LISTEN) {
+                int cfd;
+                while ((cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    session_open(&srv, cfd);
+                }
+            } else if (src->kind == SRC_CONN) {
+                session_event(&srv, src->session, events[i].events);
+            } else if (src->kind == SRC_OUTPUT) {
+                session_collect(&srv, src->session);
+                session_pump(&srv, src->session);
+            } else if (src->kind == SRC_CAPTURE) {
+                session_capture(&srv, src->session);
+                session_pump(&srv, src->session);
+            } else if (src->kind == SRC_ZYGOTE) {
+                if (zygote_fd >= 0) {
+                    server_zygote_readable(&srv);
+                }
+            } else {
+                Session *s = src->session;
+                for (int j = 0; j < s->job.count;) {
                     int status;
-                    waitpid(pid, &status, 0);
-                    if (WIFEXITED(status)) {
-                        last_status = WEXITSTATUS(status);
-                        if (last_status != 0) {
-                            has_error = 1;
-                        }
+                    struct rusage usage;
+                    if (wait4(s->job.pids[j], &status, WNOHANG, &usage) == s->job.pids[j]) {
+                        session_reap(&srv, s, j, status, &usage);
                     } else {
-                        last_status = 1;
-                        has_error = 1;
+                        j++;
                     }
-                } else {
-                    // Fork failed
-                    perror("Fork failed");
-                    last_status = 1;
-                    has_error = 1;
                 }
+                session_pump(&srv, s);
             }
         }
-        
-        // Restore original file descriptors
-        dup2(original_stdin, STDIN_FILENO);
-        dup2(original_stdout, STDOUT_FILENO);
-        dup2(original_stderr, STDERR_FILENO);
-        close(original_stdin);
-        close(original_stdout);
-        close(original_stderr);
+    }
+
+    close(lfd);
+    unlink(socket_path);
+    return 1;
+}
+
+int microshell_main(int argc, char *argv[]) {
+    char buf[BUF_SIZE];
+    int last_status = 0;
+    int has_error = 0;
 
-        // Free argument arrays
-        for (int j = 0; j < cmd_count; j++) {
-            if (cmd_args[j]) free(cmd_args[j]);
+    // `--zygote` launches commands from a small helper forked right away
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--zygote") == 0) {
+            zygote_start();
         }
-        free(cmd_args);
-        
-        for (int j = 0; j < token_count; j++) {
-            if (tokens[j]) free(tokens[j]);
+    }
+
+    // `--server PATH` serves sessions over a Unix socket instead of stdin
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            return microshell_server(argv[i + 1]);
+        }
+    }
+
+    while (1) {
+        printf(PROMPT);
+        fflush(stdout);
+
+        if (fgets(buf, BUF_SIZE, stdin) == NULL) {
+            break;
+        }
+
+        buf[strcspn(buf, "\n")] = 0;  // remove newline
+
+        if (strlen(buf) == 0) continue;
+
+        if (execute_line(buf, &last_status, &has_error, NULL)) {
+            free_variables();
+            return has_error ? 1 : last_status;
         }
-        free(tokens);
-        
-        free(expanded_buf);
     }
 
     free_variables();
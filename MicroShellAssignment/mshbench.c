@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define BUF_SIZE 65536
+#define PROMPT "Nano Shell Prompt > "
+
+// Load test for `microshell_main --server PATH`: opens many sessions from
+// several threads, runs a command a few times in each and reports sessions
+// per second and command latency percentiles.
+
+typedef struct {
+    const char *path;
+    const char *command;
+    int sessions;
+    int commands;
+    double *latencies;      // one per command, in microseconds
+    int latency_count;
+    int failures;
+} Worker;
+
+double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int connect_shell(const char *path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Discard output until the session prints its next prompt
+int wait_prompt(int fd) {
+    char buf[BUF_SIZE];
+    size_t plen = strlen(PROMPT);
+    size_t held = 0;
+
+    while (1) {
+        ssize_t n = read(fd, buf + held, sizeof(buf) - held);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        size_t len = held + n;
+        if (len >= plen && memcmp(buf + len - plen, PROMPT, plen) == 0) return 0;
+        held = len < plen ? len : plen - 1;
+        memmove(buf, buf + len - held, held);
+    }
+}
+
+void *worker_run(void *arg) {
+    Worker *w = (Worker *) arg;
+    size_t cmd_len = strlen(w->command);
+    char buf[BUF_SIZE];
+
+    for (int i = 0; i < w->sessions; i++) {
+        int fd = connect_shell(w->path);
+        if (fd < 0 || wait_prompt(fd) < 0) {
+            w->failures++;
+            if (fd >= 0) close(fd);
+            continue;
+        }
+        for (int j = 0; j < w->commands; j++) {
+            double start = now_us();
+            if (write(fd, w->command, cmd_len) != (ssize_t) cmd_len ||
+                write(fd, "\n", 1) != 1 || wait_prompt(fd) < 0) {
+                w->failures++;
+                break;
+            }
+            w->latencies[w->latency_count++] = now_us() - start;
+        }
+        if (write(fd, "exit\n", 5) == 5) {
+            while (read(fd, buf, sizeof(buf)) > 0) {
+            }
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double *sorted, int count, double p) {
+    if (count == 0) return 0;
+    int idx = (int) (p * (count - 1) + 0.5);
+    return sorted[idx];
+}
+
+int main(int argc, char *argv[]) {
+    int sessions = 200, commands = 10, threads = 8;
+    const char *command = "echo hello";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:c:t:x:")) != -1) {
+        switch (opt) {
+        case 's': sessions = atoi(optarg); break;
+        case 'c': commands = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'x': command = optarg; break;
+        default:
+            printf("Usage:  %s [-s sessions] [-c commands] [-t threads] [-x command] socket-path\n", argv[0]);
+            exit(-1);
+        }
+    }
+    if (optind >= argc || sessions < 1 || commands < 1 || threads < 1) {
+        printf("Usage:  %s [-s sessions] [-c commands] [-t threads] [-x command] socket-path\n", argv[0]);
+        exit(-1);
+    }
+    if (threads > sessions) threads = sessions;
+
+    Worker *workers = (Worker *) calloc(threads, sizeof(Worker));
+    pthread_t *tids = (pthread_t *) malloc(threads * sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) {
+        workers[i].path = argv[optind];
+        workers[i].command = command;
+        workers[i].sessions = sessions / threads + (i < sessions % threads);
+        workers[i].commands = commands;
+        workers[i].latencies = (double *) malloc(workers[i].sessions * commands * sizeof(double));
+    }
+
+    double start = now_us();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, worker_run, &workers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_us() - start;
+
+    int total = 0, failures = 0;
+    double *all = (double *) malloc(sessions * commands * sizeof(double));
+    for (int i = 0; i < threads; i++) {
+        memcpy(all + total, workers[i].latencies, workers[i].latency_count * sizeof(double));
+        total += workers[i].latency_count;
+        failures += workers[i].failures;
+        free(workers[i].latencies);
+    }
+    qsort(all, total, sizeof(double), compare_double);
+
+    printf("sessions:      %d (%d threads, %d commands each, %d failures)\n",
+           sessions, threads, commands, failures);
+    printf("sessions/sec:  %.1f\n", sessions / (elapsed / 1e6));
+    printf("latency p50:   %.1f us\n", percentile(all, total, 0.50));
+    printf("latency p99:   %.1f us\n", percentile(all, total, 0.99));
+    printf("latency max:   %.1f us\n", total ? all[total - 1] : 0.0);
+
+    free(all);
+    free(tids);
+    free(workers);
+    return failures ? 1 : 0;
+}
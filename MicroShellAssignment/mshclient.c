@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define BUF_SIZE 65536
+#define PROMPT "Nano Shell Prompt > "
+
+// Client for `microshell_main --server PATH`.
+//   mshclient PATH            relay stdin/stdout to a session
+//   mshclient PATH -c "cmd"   run one line and print its output
+
+int connect_shell(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Copy session output to `out` (or drop it if out < 0) until the next prompt
+int read_until_prompt(int fd, int out) {
+    char buf[BUF_SIZE];
+    size_t plen = strlen(PROMPT);
+    size_t held = 0; // trailing bytes that may be the start of a prompt
+
+    while (1) {
+        ssize_t n = read(fd, buf + held, sizeof(buf) - held);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (out >= 0) write_all(out, buf, held);
+            return -1;
+        }
+        size_t len = held + n;
+        if (len >= plen && memcmp(buf + len - plen, PROMPT, plen) == 0) {
+            if (out >= 0) write_all(out, buf, len - plen);
+            return 0;
+        }
+        held = len < plen ? len : plen - 1;
+        if (out >= 0) write_all(out, buf, len - held);
+        memmove(buf, buf + len - held, held);
+    }
+}
+
+int run_one(int fd, const char *cmd) {
+    if (read_until_prompt(fd, -1) < 0) return 1;
+    if (write_all(fd, cmd, strlen(cmd)) < 0 || write_all(fd, "\n", 1) < 0) {
+        perror("write");
+        return 1;
+    }
+    int rc = read_until_prompt(fd, STDOUT_FILENO) < 0 ? 1 : 0;
+    write_all(fd, "exit\n", 5);
+    return rc;
+}
+
+int relay(int fd) {
+    char buf[BUF_SIZE];
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = fd, .events = POLLIN },
+    };
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return 1;
+        }
+        if (fds[0].revents) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n <= 0) {
+                // Let the server finish the queued lines and hang up
+                shutdown(fd, SHUT_WR);
+                fds[0].fd = -1;
+            } else if (write_all(fd, buf, n) < 0) {
+                perror("write");
+                return 1;
+            }
+        }
+        if (fds[1].revents) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) return 0;
+            write_all(STDOUT_FILENO, buf, n);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && !(argc == 4 && strcmp(argv[2], "-c") == 0)) {
+        printf("Usage:  %s socket-path [-c command]\n", argv[0]);
+        exit(-1);
+    }
+
+    int fd = connect_shell(argv[1]);
+    if (fd < 0) exit(-2);
+
+    int rc = argc == 4 ? run_one(fd, argv[3]) : relay(fd);
+    close(fd);
+    return rc;
+}